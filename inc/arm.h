@@ -34,6 +34,15 @@ timestamp()
     return t;
 }
 
+/* Frequency of the system counter read by timestamp(), in Hz. */
+static inline uint64_t
+timerfreq()
+{
+    uint64_t f;
+    asm volatile ("mrs %[freq], cntfrq_el0" : [freq]"=r"(f));
+    return f;
+}
+
 static inline void
 put32(uint64_t p, uint32_t x)
 {
@@ -60,6 +69,13 @@ cli()
     asm volatile("msr daif, %[x]" : : [x]"r"(0xF << 6));
 }
 
+/* Sleep until an interrupt is pending, even a masked one. */
+static inline void
+wfi()
+{
+    asm volatile("dsb sy; wfi" : : : "memory");
+}
+
 /* Brute-force data and instruction synchronization barrier. */
 static inline void
 disb()
@@ -93,6 +109,15 @@ relr()
     return r;
 }
 
+/* Read Fault Address Register (EL1). */
+static inline uint64_t
+rfar()
+{
+    uint64_t r;
+    asm volatile("mrs %[x], far_el1" : [x]"=r"(r));
+    return r;
+}
+
 /* Load Exception Syndrome Register (EL1). */
 static inline void
 lesr(uint64_t r)
@@ -109,16 +134,44 @@ lvbar(void *p)
     disb();
 }
 
-/* Load Translation Table Base Register 0 (EL1). */
+/*
+ * Load Translation Table Base Register 0 (EL1) tagged with asid.
+ * Entries of other ASIDs stay in the TLB, so no flush is needed.
+ */
 static inline void
-lttbr0(uint64_t p)
+lttbr0(uint64_t p, uint64_t asid)
+{
+    asm volatile("msr ttbr0_el1, %[x]" : : [x]"r"(p | (asid << 48)));
+    asm volatile("isb");
+}
+
+/* Invalidate all TLB entries of this cpu. */
+static inline void
+tlbi_all()
 {
-    asm volatile("msr ttbr0_el1, %[x]" : : [x]"r"(p));
     disb();
     asm volatile("tlbi vmalle1");
     disb();
 }
 
+/* Invalidate TLB entries tagged with asid on all cpus. */
+static inline void
+tlbi_asid(uint64_t asid)
+{
+    disb();
+    asm volatile("tlbi aside1is, %[x]" : : [x]"r"(asid << 48));
+    disb();
+}
+
+/* Invalidate TLB entries of all cpus for virtual address va. */
+static inline void
+tlbi_va(uint64_t va)
+{
+    disb();
+    asm volatile("tlbi vaae1is, %[x]" : : [x]"r"(va >> 12));
+    disb();
+}
+
 /* Load Translation Table Base Register 1 (EL1). */
 static inline void
 lttbr1(uint64_t p)
@@ -24,6 +24,7 @@ struct buf {
     struct buf *next;
 
     struct list_head node_buf;
+    struct list_head hash;  /* Link in a bcache hash chain */
 };
 
 #endif
@@ -4,14 +4,24 @@
 #include "types.h"
 
 // #define PRINT_TRACE
+// #define KALLOC_JUNK      /* Fill allocated and freed pages with junk */
+// #define SYSCALL_STATS    /* Count system calls and time them, see the sysstat device */
+// #define TEST_SPINLOCK    /* Run the spinlock contention test on all cpus at boot */
+// #define NO_ASID          /* Flush the TLB on every switch instead of using ASIDs */
 
 struct buf;
 struct file;
 struct inode;
+struct ktimer;
+struct proc;
 struct spinlock;
+struct rwspinlock;
+struct seqlock;
+struct lockstat;
 struct stat;
 struct superblock;
 struct trapframe;
+struct usage;
 
 // bio.c
 void            binit();
@@ -37,6 +47,7 @@ int             dirlink(struct inode *, char *, uint32_t);
 struct inode *  dirlookup(struct inode *, char *, size_t *);
 struct inode *  ialloc(uint32_t, short);
 struct inode *  idup(struct inode *);
+void            icache_init();
 void            iinit(int dev);
 void            ilock(struct inode *);
 void            iput(struct inode *);
@@ -61,14 +72,27 @@ void            proc_init();
 void            user_init();
 void            scheduler();
 void            yield();
+void            preempt();
 void            exit();
 int             fork();
-int             wait();
+int             vfork(uint64_t);
+void            vfork_done();
+int             wait(int, int *, int, struct usage *);
+void            charge(int);
 void            sleep(void *, struct spinlock *);
+int             sleep_timeout(void *, struct spinlock *, uint64_t);
+int             sleep_until(uint64_t);
 void            wakeup(void *);
+void            wakeup_one(void *);
 void            drop_priority();
 void            raise_priority();
-void            set_cpus_allowed(int);
+int             sched_tick();
+int             need_resched();
+void            priority_boost();
+int             set_cpus_allowed(int, int);
+int             get_cpus_allowed(int);
+int             set_nice(int, int);
+int             get_nice(int, int *);
 int             growproc(int);
 
 // sd.c
@@ -82,26 +106,66 @@ int             holding(struct spinlock *);
 void            acquire(struct spinlock *);
 void            release(struct spinlock *);
 void            initlock(struct spinlock *, char *);
+void            initrwlock(struct rwspinlock *, char *);
+void            acquireread(struct rwspinlock *);
+void            releaseread(struct rwspinlock *);
+void            acquirewrite(struct rwspinlock *);
+void            releasewrite(struct rwspinlock *);
+void            initseqlock(struct seqlock *, char *);
+void            acquireseq(struct seqlock *);
+void            releaseseq(struct seqlock *);
+uint32_t        readseqbegin(struct seqlock *);
+int             readseqretry(struct seqlock *, uint32_t);
+struct lockstat *lockstat_find(char *, int);
+void            lockstat_acquired(struct lockstat *, int, uint64_t);
+void            lockstat_released(struct lockstat *, uint64_t);
+void            lockstat_dump();
 
 // syscall.c
+int             uaccess(uint64_t, uint64_t, int);
 int             fetchstr(uint64_t, char **);
 int             argint(int, uint64_t *);
-int             argptr(int, char **, int);
+int             argptr(int, char **, uint64_t, int);
 int             argstr(int, char **);
-int             syscall1(struct trapframe *);
+int64_t         syscall1(struct trapframe *);
+void            sysstat_init();
 
 // sysfile.c
 struct inode *  create(char *path, short type, short major, short minor);
 
+// wheel.c
+void            wheel_init();
+void            ktimer_init(struct ktimer *, void (*)(void *), void *);
+void            ktimer_add(struct ktimer *, uint64_t);
+int             ktimer_del(struct ktimer *);
+void            wheel_run(uint64_t);
+uint64_t        wheel_next();
+
 // trap.c
 void            trap(struct trapframe *);
 void            irq_init();
+void            ipi_init();
+void            ipi_send(int);
 void            irq_error();
 
+// mmap.c
+void            vma_init();
+struct vma *    vma_find(struct proc *, uint64_t);
+int             vma_overlap(struct proc *, uint64_t, uint64_t);
+uint64_t        vma_map(uint64_t, uint64_t, int, int, struct file *, uint64_t);
+int             vma_unmap(uint64_t, uint64_t);
+int             vma_dontneed(uint64_t, uint64_t);
+int             vma_fault(struct proc *, uint64_t, int);
+int             vma_access(struct proc *, uint64_t, uint64_t, int);
+int             vma_copy(struct proc *, struct proc *);
+void            vma_release(struct proc *);
+
 // vm.c
 void            vm_free(uint64_t *, int);
+uint64_t *      pgdir_walk(uint64_t *, const void *, int64_t);
 uint64_t *      pgdir_init();
 void            uvm_init(uint64_t *, char *, int);
+void            asid_init();
 void            uvm_switch(struct proc *);
 int             uvm_alloc(uint64_t *, uint64_t, uint64_t);
 int             uvm_dealloc(uint64_t *, uint64_t, uint64_t);
@@ -110,12 +174,19 @@ void            clearpteu(uint64_t *, char *);
 int             copyout(uint64_t *, uint64_t, void *, uint64_t);
 char *          uva2ka(uint64_t *, char *);
 uint64_t *      copyuvm(uint64_t *, uint64_t);
+int             uvm_copy(uint64_t *, uint64_t *, uint64_t, uint64_t, int);
+int             uvm_map(uint64_t *, uint64_t, char *, int64_t);
+int             uvm_cow(uint64_t *, uint64_t);
+int             uvm_demand(uint64_t *, uint64_t);
 void            test_mem();
 
 
 // fstest.c
 void            test_file_system();
 
+// spinlock_test.c
+void            test_spinlock();
+
 // debug.c
 void            printbufassb(struct buf *);
 
@@ -4,9 +4,11 @@
 #include <sys/stat.h>
 #include "types.h"
 #include "sleeplock.h"
+#include "list.h"
 #include "fs.h"
 
-#define NFILE 100  // Open files per system
+#define NFILE 100       // Minimum limit of open files per system
+#define FILE_PAGES 32   // Free pages at boot per open file beyond that
 
 struct file {
     enum { FD_NONE, FD_PIPE, FD_INODE } type;
@@ -24,6 +26,7 @@ struct inode {
     uint32_t dev;             // Device number
     uint32_t inum;            // Inode number
     int ref;                  // Reference count
+    struct list_head list;    // Link in an icache hash chain
     struct sleeplock lock;    // Protects everything below here
     int valid;                // Inode has been read from disk?
 
@@ -11,9 +11,11 @@
 
 // Kernel only
 #define NDEV            10                  // Maximum major device number
-#define NINODE          50                  // Maximum number of active i-nodes
+#define NINODE          50                  // Minimum limit of active i-nodes
+#define INODE_PAGES     64                  // Free pages at boot per i-node beyond that
 #define MAXOPBLOCKS     10                  // Max # of blocks any FS op writes
-#define NBUF            (MAXOPBLOCKS*3)     // Size of disk block cache
+#define NBUF            (MAXOPBLOCKS*3)     // Minimum size of disk block cache
+#define BUF_PAGES       128                 // Free pages at boot per buffer beyond that
 
 // mkfs only
 #define FSSIZE          1000                // Size of file system in blocks
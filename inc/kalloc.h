@@ -1,10 +1,23 @@
 #ifndef KERN_KALLOC_H
 #define KERN_KALLOC_H
 
+#include <stddef.h>
+
+#define MAX_ORDER 10    /* Buddy orders 0..9, i.e. blocks of 4 KiB to 2 MiB */
+
 void alloc_init();
 char *kalloc();
+char *kalloc_zeroed();
+int kalloc_zero_fill();
 void kfree(char*);
+void kdup(char *);
+int kref(char *);
+char *alloc_pages(int);
+void free_pages(char *, int);
 void free_range(void *, void *);
+int kmem_nfree();
+void *alloc_table(int *, size_t);
 void check_free_list();
+void kmem_stat();
 
 #endif /* !KERN_KALLOC_H */
@@ -0,0 +1,21 @@
+#ifndef INC_MMAP_H
+#define INC_MMAP_H
+
+#include "types.h"
+#include "list.h"
+
+/*
+ * A mapping created by mmap(), covering [start, end) of the
+ * process's address space above its heap. Pages are filled in
+ * on first touch, from the file when there is one.
+ */
+struct vma {
+    struct list_head list;   /* Link in proc->vmas, sorted by start */
+    uint64_t start, end;     /* Page aligned bounds                 */
+    int prot;                /* PROT_* bits                         */
+    int flags;               /* MAP_* bits                          */
+    struct file *file;       /* Backing file, null if anonymous     */
+    uint64_t off;            /* File offset of start                */
+};
+
+#endif
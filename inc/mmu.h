@@ -41,8 +41,10 @@
 #define PTE_RO       (1<<7)      /* read-only */
 #define PTE_SH       (3<<8)      /* Shareability */
 #define PTE_AF       (1<<10)     /* P2066 access flags */
-/* Address in page table or page directory entry */
-#define PTE_ADDR(pte)   ((uint64_t)(pte) & ~0xFFF)
+#define PTE_NG       (1<<11)     /* not global, TLB entry tagged with ASID */
+#define PTE_COW      (1UL<<55)   /* software: read-only copy-on-write page */
+/* Address in page table or page directory entry, bits [47:12] */
+#define PTE_ADDR(pte)   ((uint64_t)(pte) & 0xFFFFFFFFF000)
 #define PTE_FLAGS(pte)  ((unsigned)(pte) &  0xFFF)
 
 /* P2061 */
@@ -59,6 +61,14 @@
 #define PTE_NORMAL      (MM_TYPE_BLOCK | (MT_NORMAL << 2) | PTE_AF)
 #define PTE_DEVICE      (MM_TYPE_BLOCK | (MT_DEVICE_nGnRnE << 2) | PTE_AF)
 
+/*
+ * Address space identifiers. TCR_EL1.AS = 0 selects 8-bit ASIDs
+ * and TCR_EL1.A1 = 0 takes them from TTBR0_EL1.
+ */
+#define ASID_BITS       8
+#define NASID           (1 << ASID_BITS)
+#define ASID(x)         ((x) & (NASID - 1))
+
 /* Translation Control Register */
 /*
  * Intermediate physical address size 32 bits, 4GB
@@ -25,6 +25,7 @@
 #define IRQ_SRC_CORE(i)         (LOCAL_BASE + 0x60 + 4*(i))
 #define IRQ_TIMER               (1 << 11)   /* Local Timer */
 #define IRQ_GPU                 (1 << 8)
+#define IRQ_MAILBOX0            (1 << 4)    /* Core mailbox 0 */
 #define IRQ_CNTPNSIRQ           (1 << 1)    /* Core Timer */
 
 /* Local timer */
@@ -40,6 +41,12 @@
 #define TIMER_CLR_INT           (1 << 31)
 #define TIMER_RELOAD            (1 << 30)
 
+/* Core mailboxes, used for inter-processor interrupts */
+#define MBOX_CTRL(i)            (LOCAL_BASE + 0x50 + 4*(i))
+#define MBOX_IRQ(n)             (1 << (n))
+#define MBOX_SET(i, n)          (LOCAL_BASE + 0x80 + 0x10*(i) + 4*(n))
+#define MBOX_CLR(i, n)          (LOCAL_BASE + 0xC0 + 0x10*(i) + 4*(n))
+
 /* Core Timer */
 #define CORE_TIMER_CTRL(i)      (LOCAL_BASE + 0x40 + 4*(i))
 #define CORE_TIMER_ENABLE       (1 << 1)    /* CNTPNSIRQ */
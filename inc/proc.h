@@ -6,17 +6,45 @@
 #include "arm.h"
 #include "trap.h"
 #include "spinlock.h"
+#include "list.h"
+#include "wheel.h"
 
 #define NCPU   4        /* maximum number of CPUs */
-#define NPROC 64        /* maximum number of processes */
+#define NPROC 64        /* minimum number of processes */
+#define PROC_PAGES 256  /* free pages at boot per process slot beyond that */
 #define NOFILE 16       /* open files per process */
 #define KSTACKSIZE 4096 /* size of per-process kernel stack */
+#define USTACKSIZE (16*4096) /* size of user stack, allocated on demand */
+
+/*
+ * Multi-level feedback queue. A process starts at the top level,
+ * NPRIO-1, and drops a level each time it uses up the quantum of
+ * its level. Every BOOST_SECS seconds all go back to the top.
+ */
+#define NPRIO  4                /* levels, higher runs first */
+#define QUANTA { 8, 4, 2, 1 }   /* timer ticks per slice, level 0 first */
+#define BOOST_SECS 1            /* seconds between priority boosts */
 
 #define thiscpu (&cpus[cpuid()])
+#define ALLCPUS ((1 << NCPU) - 1)
+
+/*
+ * Per-CPU queue of RUNNABLE processes waiting to run there, one
+ * FIFO list per priority. Lock order is ptable.lock, then lock.
+ */
+struct runqueue {
+    struct spinlock lock;
+    struct list_head queue[NPRIO];
+    volatile uint32_t bitmap;   /* Bit i set if queue[i] is non-empty */
+    volatile int nr;            /* Processes queued, read without lock */
+    volatile int nallow[NCPU];  /* Of those, how many cpu i may run */
+} __attribute__((aligned(64)));
 
 struct cpu {
     struct context *scheduler;  /* swtch() here to enter scheduler */
     struct proc *proc;          /* The process running on this cpu or null */
+    struct runqueue rq;         /* Processes waiting for this cpu */
+    volatile int idle;          /* Asleep in wfi(), needs an IPI to wake */
 };
 
 extern struct cpu cpus[NCPU];
@@ -45,25 +73,58 @@ struct context {
     uint64_t x30;
 };
 
+/* Resource usage, times in ticks of the system counter. */
+struct usage {
+    uint64_t utime, stime;   /* Time spent in user and kernel mode      */
+    uint64_t minflt, majflt; /* Page faults without and with file reads */
+    uint64_t nvcsw, nivcsw;  /* Voluntary and involuntary switches away */
+};
+
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 struct proc {
     uint64_t sz;             /* Size of process memory (bytes)          */
+    uint64_t ustack;         /* Bottom of user stack, [ustack, sz) is demand-zero */
+    uint64_t heap;           /* Start of heap, brk cannot go below it   */
+    struct list_head vmas;   /* Memory mappings, see mmap.c             */
     uint64_t *pgdir;         /* Page table                              */
+    uint64_t asid;           /* Generation and ASID tagging its TLB entries */
     char *kstack;            /* Bottom of kernel stack for this process */
     enum procstate state;    /* Process state                           */
     int pid;                 /* Process ID                              */
     struct proc *parent;     /* Parent process                          */
+    struct list_head children; /* Its children, linked by sibling       */
+    struct list_head sibling; /* Link in parent's children, or free list */
+    struct list_head pid_node; /* Link in the pid hash table            */
+    int xstate;              /* Wait status for the parent              */
     struct trapframe *tf;    /* Trapframe for current syscall           */
     struct context *context; /* swtch() here to run process             */
     void *chan;              /* If non-zero, sleeping on chan           */
     int killed;              /* If non-zero, have been killed           */
+    int vfork;               /* Borrowing parent's pgdir until exec/exit */
     char name[16];           /* Process name (debugging)                */
 
     struct file *ofile[NOFILE];  /* Open files */
     struct inode *cwd;           /* Current directory */
     int priority;            /* Scheduling priority                     */
+    int ticks;               /* Ticks used of the quantum at priority   */
     int cpus_allowed;        /* Mask allowed CPUs                       */
+    int nice;                /* -20..19, a positive one caps priority   */
+    int cpu;                 /* CPU last run on, or -1                  */
+    int on_cpu;              /* Context in use by a cpu, see scheduler() */
+    struct list_head rq_node; /* Link in a runqueue while RUNNABLE      */
+    struct list_head sleep_node; /* Link in a sleep queue while SLEEPING */
+    struct ktimer timer;     /* Deadline of sleep_timeout()             */
+
+    /* Scheduler statistics, see procdump() */
+    int nswitch;             /* Times switched to                       */
+    uint64_t queued;         /* Counter value when last made RUNNABLE   */
+    uint64_t wait;           /* Counter ticks spent RUNNABLE            */
+
+    /* Accounting, see charge() */
+    struct usage ru;         /* Usage of this process                   */
+    struct usage cru;        /* Usage of its children waited for        */
+    uint64_t stamp;          /* Counter value when last charged         */
 };
 
 static inline struct proc *
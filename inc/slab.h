@@ -0,0 +1,43 @@
+#ifndef INC_SLAB_H
+#define INC_SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spinlock.h"
+#include "list.h"
+#include "proc.h"
+
+#define SLAB_CPU_CACHE  16  /* Objects kept on each per-CPU stack */
+
+/* Per-CPU stack of free objects, touched without locking. */
+struct kmem_cache_cpu {
+    int avail;
+    void *stack[SLAB_CPU_CACHE];
+} __attribute__((aligned(64)));
+
+/*
+ * A cache of equally sized objects carved out of kalloc() pages.
+ * Objects handed out by kmem_cache_alloc() have been through ctor
+ * once and must be given back to kmem_cache_free() in that state.
+ */
+struct kmem_cache {
+    char *name;
+    size_t size;                /* Object size, 8-byte aligned       */
+    size_t offset;              /* Free list link within an object   */
+    int nobj;                   /* Objects per slab page             */
+    void (*ctor)(void *);       /* Constructor, may be null          */
+
+    struct spinlock lock;       /* Protects the slab lists           */
+    struct list_head partial;   /* Slabs with some objects free      */
+    struct list_head full;      /* Slabs with no object free         */
+    int nslab;                  /* Pages owned by this cache         */
+
+    struct kmem_cache_cpu cpu[NCPU];
+};
+
+void kmem_cache_init(struct kmem_cache *, char *, size_t, void (*)(void *));
+void *kmem_cache_alloc(struct kmem_cache *);
+void kmem_cache_free(struct kmem_cache *, void *);
+
+#endif
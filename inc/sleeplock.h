@@ -9,10 +9,17 @@ struct sleeplock {
     int locked;         /* Is the lock held? */
     struct spinlock lk; /* Spinlock protecting this sleep lock */
     int pid;
+    struct proc *owner; /* Process holding the lock, for spinning on */
+    struct proc *handoff; /* Sleeper to pass the lock to on release */
+#ifdef LOCKSTAT
+    struct lockstat *stat;
+    uint64_t stamp;     /* When the lock was taken */
+#endif
 };
 
 void initsleeplock(struct sleeplock *lk, char *name);
 void acquiresleep(struct sleeplock *lk);
 void releasesleep(struct sleeplock *lk);
 int holdingsleep(struct sleeplock *lk);
+void sleeplock_stat();
 #endif
@@ -1,12 +1,67 @@
 #ifndef INC_SPINLOCK_H
 #define INC_SPINLOCK_H
 
+#include <stdint.h>
+
+// #define LOCKSTAT         /* Keep contention statistics per lock name, dump with ^L */
+
+/*
+ * Contention statistics, shared by all locks of one kind with the
+ * same name. Times are in system counter ticks.
+ */
+struct lockstat {
+    char *name;             /* Set once the entry is filled in. */
+    int sleep;              /* Sleep locks are counted apart. */
+    int claimed;            /* Taken by some lockstat_find(). */
+    uint64_t acquired;      /* Acquisitions. */
+    uint64_t contended;     /* Acquisitions that had to wait. */
+    uint64_t wait;          /* Total time spent waiting. */
+    uint64_t maxhold;       /* Longest time the lock was held. */
+};
+
+/*
+ * A ticket lock: acquire() takes the next ticket and waits until
+ * owner reaches it, so cpus get the lock in the order they asked.
+ * The lock is free when owner == next.
+ */
 struct spinlock {
-    volatile int locked;
-    
+    volatile uint16_t owner;    /* Ticket being served. */
+    volatile uint16_t next;     /* Next ticket to hand out. */
+
     /* For debugging: */
     char        *name;      /* Name of lock. */
     struct cpu  *cpu;       /* The cpu holding the lock. */
+#ifdef LOCKSTAT
+    struct lockstat *stat;
+    uint64_t    stamp;      /* When the lock was taken. */
+#endif
+};
+
+/*
+ * A reader-writer spinlock: any number of readers, or one writer.
+ * A waiting writer sets RW_WRITER at once, so no new reader gets in
+ * and the readers inside drain out.
+ */
+#define RW_WRITER   (1U << 31)
+
+struct rwspinlock {
+    volatile uint32_t cnt;  /* RW_WRITER, plus the number of readers. */
+    char        *name;
+#ifdef LOCKSTAT
+    struct lockstat *stat;
+    uint64_t    stamp;      /* When the writer took the lock */
+#endif
+};
+
+/*
+ * A sequence lock: writers serialize on lock and make seq odd while
+ * they update, readers take no lock and retry if seq changed under
+ * them. Readers must cope with seeing a half-written update before
+ * they retry.
+ */
+struct seqlock {
+    volatile uint32_t seq;
+    struct spinlock lock;
 };
 
 #endif
@@ -32,6 +32,7 @@
 /* SPSR_EL1/2/3, Saved Program Status Register. */
 #define SPSR_MASK_ALL               (7 << 6)
 #define SPSR_EL1h                   (5 << 0)
+#define SPSR_M_MASK                 (0xF << 0)  /* 0 when taken from EL0 */
 #define SPSR_EL2h                   (9 << 0)
 #define SPSR_EL3_VALUE              (SPSR_MASK_ALL | SPSR_EL2h)
 #define SPSR_EL2_VALUE              (SPSR_MASK_ALL | SPSR_EL1h)
@@ -40,9 +41,16 @@
 #define EC_SHIFT                    26
 #define EC_UNKNOWN                  0x00
 #define EC_SVC64                    0x15
-#define EC_DABORT                   0x24
+#define EC_DABORT                   0x24    /* Data abort from EL0 */
+#define EC_DABORT_EL1               0x25    /* Data abort from EL1 */
 #define EC_IABORT                   0x20
 
 #define ISS_MASK                    0xFFFFFF
 
+/* ISS of data aborts. */
+#define ISS_WNR                     (1 << 6)    /* Caused by a write */
+#define ISS_DFSC_MASK               0x3F        /* Data fault status code */
+#define DFSC_TRANS_FAULT(dfsc)      (((dfsc) & 0x3C) == 0x04)
+#define DFSC_PERM_FAULT(dfsc)       (((dfsc) & 0x3C) == 0x0C)
+
 #endif
@@ -1,8 +1,15 @@
 #ifndef INC_TIMER_H
 #define INC_TIMER_H
 
+/* Scheduler ticks per second, the tick period is cntfrq_el0 / HZ. */
+#ifndef HZ
+#define HZ 100
+#endif
+
 void timer_init();
-void timer_reset();
+void timer_program();
+void timer_stop();
+void timer_start();
 void timer();
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef INC_WHEEL_H
+#define INC_WHEEL_H
+
+#include "types.h"
+#include "list.h"
+
+/*
+ * Each cpu keeps its timers on a hierarchical timer wheel of
+ * WHEEL_LEVELS levels with WHEEL_SLOTS slots each. A slot of
+ * level 0 spans one jiffy of 1/WHEEL_HZ s, a slot of level l
+ * spans WHEEL_SLOTS^l jiffies. Adding and removing a timer is
+ * O(1); timers move down a level at most WHEEL_LEVELS-1 times.
+ */
+#define WHEEL_HZ        10000
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    4
+
+/*
+ * A timer calls fn(arg) from the timer interrupt of the cpu it
+ * was added on, once the system counter reaches its deadline.
+ * fn runs with no wheel lock held.
+ */
+struct ktimer {
+    struct list_head node;   /* Link in a wheel slot while pending  */
+    uint64_t expires;        /* Deadline in jiffies                 */
+    void (*fn)(void *);
+    void *arg;
+    int cpu;                 /* Wheel it is on, or -1 if not pending */
+};
+
+#endif
@@ -13,6 +13,10 @@
  * * Only one process at a time can use a buffer,
  *     so do not keep them longer than necessary.
  *
+ * The cache is sized at boot from free memory. Buffers are found
+ * through a hash table on the block number and recycled in LRU
+ * order, so lookups do not slow down as the cache grows.
+ *
  * The implementation uses two state flags internally:
  * * B_VALID: the buffer data has been read from the disk.
  * * B_DIRTY: the buffer data has been modified
@@ -25,15 +29,23 @@
 #include "console.h"
 #include "sd.h"
 #include "fs.h"
+#include "kalloc.h"
 #include "defs.h"
 
+#define BHASH(blockno)  (&bcache.hash[(blockno) % bcache.nhash])
+
 struct {
     struct spinlock lock;
-    struct buf buf[NBUF];
+    struct buf *buf;
+    int nbuf;
 
     // Linked list of all buffers, through prev/next.
     // head.next is most recently used.
     struct buf head;
+
+    // Hash chains of buffers by blockno, through hash.
+    struct list_head *hash;
+    int nhash;
 } bcache;
 
 /* Initialize the cache list and locks. */
@@ -44,17 +56,26 @@ binit()
     struct buf *b;
 
     initlock(&bcache.lock, "bcache");
+    bcache.nbuf = MAX(NBUF, kmem_nfree() / BUF_PAGES);
+    bcache.buf = alloc_table(&bcache.nbuf, sizeof(struct buf));
+    bcache.nhash = bcache.nbuf / 2;
+    bcache.hash = alloc_table(&bcache.nhash, sizeof(struct list_head));
+    for (int i = 0; i < bcache.nhash; i++) {
+        INIT_LIST_HEAD(&bcache.hash[i]);
+    }
 
     // Create circular doubly linked list of buffers
     bcache.head.prev = &bcache.head;
     bcache.head.next = &bcache.head;
-    for (b = bcache.buf; b < bcache.buf + NBUF; ++b) {
+    for (b = bcache.buf; b < bcache.buf + bcache.nbuf; ++b) {
         b->next = bcache.head.next;
         b->prev = &bcache.head;
         initsleeplock(&b->lock, "buffer");
+        INIT_LIST_HEAD(&b->hash);
         bcache.head.next->prev = b;
         bcache.head.next = b;
     }
+    cprintf("binit: %d buffers\n", bcache.nbuf);
 }
 
 /*
@@ -68,11 +89,13 @@ bget(uint32_t dev, uint32_t blockno)
     /* TODO: Your code here. */
     // cprintf("bget(%d, %d)\n", dev, blockno);
     struct buf *b;
+    struct list_head *l;
 
     acquire(&bcache.lock);
 
     // Is the block already cached?
-    for (b = bcache.head.next; b != &bcache.head; b = b->next) {
+    for (l = BHASH(blockno)->next; l != BHASH(blockno); l = l->next) {
+        b = list_entry(l, struct buf, hash);
         if (b->dev == dev && b->blockno == blockno) {
             b->refcnt++;
             release(&bcache.lock);
@@ -86,6 +109,8 @@ bget(uint32_t dev, uint32_t blockno)
     // because log.c has modified it but not yet committed it.
     for (b = bcache.head.prev; b != &bcache.head; b = b->prev) {
         if (b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
+            list_del(&b->hash);
+            list_add(&b->hash, BHASH(blockno));
             b->dev = dev;
             b->blockno = blockno;
             b->flags = 0;
@@ -4,6 +4,7 @@
 #include "peripherals/irq.h"
 
 #include "console.h"
+#include "proc.h"
 #include "defs.h"
 
 void
@@ -28,7 +29,12 @@ clock_reset()
 void
 clock()
 {
+    static int secs;
+
 #ifdef PRINT_TRACE
     cprintf("clock: cpu %d clock.\n", cpuid());
 #endif
+    if (++secs % BOOST_SECS == 0) {
+        priority_boost();
+    }
 }
@@ -7,6 +7,7 @@
 #include "uart.h"
 #include "spinlock.h"
 #include "file.h"
+#include "kalloc.h"
 #include "defs.h"
 
 #define CONSOLE 1
@@ -184,7 +185,7 @@ cprintf(const char *fmt, ...)
 void
 console_intr(int (*getc)())
 {
-    int c, doprocdump = 0;
+    int c, doprocdump = 0, dokmemstat = 0, dolockstat = 0;
 
     acquire(&conslock);
     if (panicked >= 0) {
@@ -198,6 +199,12 @@ console_intr(int (*getc)())
             // procdump() locks cons.lock indirectly; invoke later
             doprocdump = 1;
             break;
+        case C('K'):  // Page allocator statistics.
+            dokmemstat = 1;
+            break;
+        case C('L'):  // Lock contention statistics.
+            dolockstat = 1;
+            break;
         case C('U'):  // Kill line.
             while (input.e != input.w && input.buf[(input.e-1) % INPUT_BUF] != '\n') {
                 input.e--;
@@ -226,6 +233,13 @@ console_intr(int (*getc)())
     release(&conslock);
 
     if (doprocdump) procdump();
+    if (dokmemstat) kmem_stat();
+    if (dolockstat) {
+        sleeplock_stat();
+#ifdef LOCKSTAT
+        lockstat_dump();
+#endif
+    }
 }
 
 void
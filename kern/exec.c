@@ -17,7 +17,7 @@ int
 execve(const char *path, char *const argv[], char *const envp[])
 {
     char *s, *last;
-    uint64_t sz, sp;
+    uint64_t sz, sp, stack;
     uint64_t ustack[3+MAXARG+1];
     int i, off, argc;
     Elf64_Ehdr elf;
@@ -73,13 +73,14 @@ execve(const char *path, char *const argv[], char *const envp[])
     ip = 0;
 
     /* TODO: Allocate user stack. */
-    // Allocate two pages at the next page boundary.
-    // Make the first inaccessible. Use the second as the user stack.
-    sz = ROUNDUP(sz, PGSIZE);
-    if ((sz = uvm_alloc(pgdir, sz, sz + 2 * PGSIZE)) == 0) {
+    // Leave an unmapped guard page at the next page boundary.
+    // The stack above it is demand-zero, except for the top page
+    // which receives the arguments.
+    stack = ROUNDUP(sz, PGSIZE) + PGSIZE;
+    sz = stack + USTACKSIZE;
+    if (uvm_alloc(pgdir, sz - PGSIZE, sz) == 0) {
         goto bad;
     }
-    clearpteu(pgdir, (char *)(sz - 2 * PGSIZE));
     sp = sz;
 
     /* TODO: Push argument strings. */
@@ -120,19 +121,28 @@ execve(const char *path, char *const argv[], char *const envp[])
         goto bad;
     }
 
+    vma_release(thisproc());
     oldpgdir = thisproc()->pgdir;
     thisproc()->pgdir = pgdir;
+    /* Take a fresh ASID rather than flush the old one everywhere. */
+    thisproc()->asid = 0;
     thisproc()->sz = sz;
+    thisproc()->ustack = stack;
+    thisproc()->heap = sz;
     thisproc()->tf->sp = sp;
     thisproc()->tf->elr = elf.e_entry;
     uvm_switch(thisproc());
-    vm_free(oldpgdir, 1);
+    if (thisproc()->vfork) {
+        vfork_done();
+    } else {
+        vm_free(oldpgdir, 0);
+    }
     return thisproc()->tf->r0;
 
 bad:
     cprintf("execve: bad\n");
     if (pgdir) {
-        vm_free(pgdir, 1);
+        vm_free(pgdir, 0);
     }
     if (ip) {
         iunlockput(ip);
@@ -5,21 +5,32 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "slab.h"
+#include "kalloc.h"
 #include "console.h"
+#include "string.h"
 #include "defs.h"
 
 struct devsw devsw[NDEV];
+/*
+ * ftable.lock guards nfile and the f->ref of every open file.
+ * filedup() only needs it shared and bumps f->ref atomically,
+ * anything that may drop a file takes it exclusive.
+ */
 struct {
-    struct spinlock lock;
-    struct file file[NFILE];
+    struct rwspinlock lock;
+    struct kmem_cache cache;
+    int nfile;              /* Open files, at most max */
+    int max;
 } ftable;
 
-/* Optional since BSS is zero-initialized. */
 void
 fileinit()
 {
     /* TODO: Your code here. */
-    initlock(&ftable.lock, "ftable");
+    initrwlock(&ftable.lock, "ftable");
+    kmem_cache_init(&ftable.cache, "file", sizeof(struct file), 0);
+    ftable.max = MAX(NFILE, kmem_nfree() / FILE_PAGES);
 }
 
 /* Allocate a file structure. */
@@ -29,16 +40,23 @@ filealloc()
     /* TODO: Your code here. */
     struct file *f;
 
-    acquire(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; ++f) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
+    acquirewrite(&ftable.lock);
+    if (ftable.nfile >= ftable.max) {
+        releasewrite(&ftable.lock);
+        return 0;
+    }
+    ftable.nfile++;
+    releasewrite(&ftable.lock);
+
+    if ((f = kmem_cache_alloc(&ftable.cache)) == 0) {
+        acquirewrite(&ftable.lock);
+        ftable.nfile--;
+        releasewrite(&ftable.lock);
+        return 0;
     }
-    release(&ftable.lock);
-    return 0;
+    memset(f, 0, sizeof(*f));
+    f->ref = 1;
+    return f;
 }
 
 /* Increment ref count for file f. */
@@ -46,12 +64,12 @@ struct file *
 filedup(struct file *f)
 {
     /* TODO: Your code here. */
-    acquire(&ftable.lock);
+    acquireread(&ftable.lock);
     if (f->ref < 1) {
         panic("filedup");
     }
-    f->ref++;
-    release(&ftable.lock);
+    __atomic_add_fetch(&f->ref, 1, __ATOMIC_RELAXED);
+    releaseread(&ftable.lock);
     return f;
 }
 
@@ -62,18 +80,20 @@ fileclose(struct file *f)
     /* TODO: Your code here. */
     struct file ff;
 
-    acquire(&ftable.lock);
+    acquirewrite(&ftable.lock);
     if (f->ref < 1) {
         panic("fileclose: invalid ref\n");
     }
     if (--f->ref >0) {
-        release(&ftable.lock);
+        releasewrite(&ftable.lock);
         return;
     }
     ff = *f;
     f->ref = 0;
     f->type = FD_NONE;
-    release(&ftable.lock);
+    ftable.nfile--;
+    releasewrite(&ftable.lock);
+    kmem_cache_free(&ftable.cache, f);
 
     if (ff.type == FD_PIPE) {
         panic("fileclose: pipe\n");
@@ -22,6 +22,8 @@
 
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
+#include "kalloc.h"
 #include "defs.h"
 
 
@@ -166,10 +168,17 @@ bfree(int dev, uint32_t b)
  * have locked the inodes involved; this lets callers create
  * multi-step atomic operations.
  *
- * The icache.lock spin-lock protects the allocation of icache
- * entries. Since ip->ref indicates whether an entry is free,
- * and ip->dev and ip->inum indicate which i-node an entry
- * holds, one must hold icache.lock while using any of those fields.
+ * The icache.lock reader-writer spin-lock protects the allocation
+ * of icache entries. Entries come from a slab cache and live on a
+ * chain of the icache.hash table while ip->ref is positive; the
+ * last iput() gives the entry back. The limit on entries and the
+ * size of the table are set at boot from free memory. Since
+ * ip->dev and ip->inum indicate which i-node an entry holds, one
+ * must hold icache.lock while using any of ip->ref, ip->dev,
+ * ip->inum and ip->list. Finding a cached inode and taking another
+ * reference only need it shared, with ip->ref bumped atomically,
+ * so concurrent lookups do not serialize; adding an entry and
+ * dropping a reference need it exclusive.
  *
  * An ip->lock sleep-lock protects all ip-> fields other than ref,
  * dev, and inum.  One must hold ip->lock in order to
@@ -177,21 +186,43 @@ bfree(int dev, uint32_t b)
  */
 
 struct {
-  struct spinlock lock;
-  struct inode inode[NINODE];
+  struct rwspinlock lock;
+  struct kmem_cache cache;
+  struct list_head *hash;   /* Referenced inodes by inum */
+  int nhash;
+  int ninode;               /* Referenced inodes, at most max */
+  int max;
 } icache;
 
-void
-iinit(int dev)
+#define IHASH(inum)     (&icache.hash[(inum) % icache.nhash])
+
+/* Slab constructor of struct inode. */
+static void
+inode_ctor(void *p)
 {
-    /* TODO: Your code here. */
-    int i = 0;
+    struct inode *ip = p;
 
-    initlock(&icache.lock, "icache");
-    for (i = 0; i < NINODE; ++i) {
-        initsleeplock(&icache.inode[i].lock, "inode");
+    initsleeplock(&ip->lock, "inode");
+}
+
+/* Set up the inode cache. Must be called before the first iget(). */
+void
+icache_init()
+{
+    initrwlock(&icache.lock, "icache");
+    kmem_cache_init(&icache.cache, "inode", sizeof(struct inode), inode_ctor);
+    icache.max = MAX(NINODE, kmem_nfree() / INODE_PAGES);
+    icache.nhash = icache.max / 2;
+    icache.hash = alloc_table(&icache.nhash, sizeof(struct list_head));
+    for (int i = 0; i < icache.nhash; i++) {
+        INIT_LIST_HEAD(&icache.hash[i]);
     }
+}
 
+void
+iinit(int dev)
+{
+    /* TODO: Your code here. */
     readsb(dev, &sb);
     cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
             inodestart %d bmap start %d\n", sb.size, sb.nblocks,
@@ -254,6 +285,25 @@ iupdate(struct inode *ip)
     brelse(bp);
 }
 
+/*
+ * The cached inode with number inum on device dev, or 0.
+ * Caller must hold icache.lock.
+ */
+static struct inode *
+ifind(uint32_t dev, uint32_t inum)
+{
+    struct list_head *l;
+    struct inode *ip;
+
+    for (l = IHASH(inum)->next; l != IHASH(inum); l = l->next) {
+        ip = list_entry(l, struct inode, list);
+        if (ip->dev == dev && ip->inum == inum) {
+            return ip;
+        }
+    }
+    return 0;
+}
+
 /*
  * Find the inode with number inum on device dev
  * and return the in-memory copy. Does not lock
@@ -263,34 +313,37 @@ static struct inode*
 iget(uint32_t dev, uint32_t inum)
 {
     /* TODO: Your code here. */
-    struct inode *ip, *empty;
-
-    acquire(&icache.lock);
+    struct inode *ip;
 
     // Is the inode already cached?
-    empty = 0;
-    for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ++ip) {
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-            ip->ref++;
-            release(&icache.lock);
-            return ip;
-        }
-        if (empty == 0 && ip->ref == 0) {   // Remember empty slot.
-            empty = ip;
-        }
+    acquireread(&icache.lock);
+    if ((ip = ifind(dev, inum))) {
+        __atomic_add_fetch(&ip->ref, 1, __ATOMIC_RELAXED);
+        releaseread(&icache.lock);
+        return ip;
+    }
+    releaseread(&icache.lock);
+
+    // Look again with the lock held exclusive, someone may have added it.
+    acquirewrite(&icache.lock);
+    if ((ip = ifind(dev, inum))) {
+        ip->ref++;
+        releasewrite(&icache.lock);
+        return ip;
     }
 
-    // Recycle an inode cache entry.
-    if (empty == 0) {
+    // Allocate an inode cache entry.
+    if (icache.ninode >= icache.max || (ip = kmem_cache_alloc(&icache.cache)) == 0) {
         panic("iget: no inodes\n");
     }
 
-    ip = empty;
     ip->dev = dev;
     ip->inum = inum;
     ip->ref = 1;
     ip->valid = 0;
-    release(&icache.lock);
+    list_add(&ip->list, IHASH(inum));
+    icache.ninode++;
+    releasewrite(&icache.lock);
 
     return ip;
 }
@@ -303,9 +356,9 @@ struct inode*
 idup(struct inode *ip)
 {
     /* TODO: Your code here. */
-    acquire(&icache.lock);
-    ip->ref++;
-    release(&icache.lock);
+    acquireread(&icache.lock);
+    __atomic_add_fetch(&ip->ref, 1, __ATOMIC_RELAXED);
+    releaseread(&icache.lock);
     return ip;
 }
 
@@ -372,9 +425,9 @@ iput(struct inode *ip)
     acquiresleep(&ip->lock);
     if (ip->valid && ip->nlink == 0) {
         // QUESTION: releasing so soon?
-        acquire(&icache.lock);
+        acquireread(&icache.lock);
         int r = ip->ref;
-        release(&icache.lock);
+        releaseread(&icache.lock);
         if (r == 1) {
             // inode had no links and other references: truncate and free.
             itrunc(ip);
@@ -385,9 +438,16 @@ iput(struct inode *ip)
     }
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
-    ip->ref--;
-    release(&icache.lock);
+    acquirewrite(&icache.lock);
+    if (--ip->ref == 0) {
+        // Give the entry back to the slab cache.
+        list_del(&ip->list);
+        icache.ninode--;
+        releasewrite(&icache.lock);
+        kmem_cache_free(&icache.cache, ip);
+        return;
+    }
+    releasewrite(&icache.lock);
 }
 
 /* Common idiom: unlock, then put. */
@@ -6,57 +6,273 @@
 #include "console.h"
 #include "kalloc.h"
 #include "spinlock.h"
+#include "list.h"
+#include "proc.h"
 #include "defs.h"
 
 extern char end[];
 
+/* Pages moved between a per-CPU cache and the buddy allocator at once. */
+#define KMEM_BATCH  32
+/* A per-CPU cache holding more pages than this is drained. */
+#define KMEM_HIGH   (2 * KMEM_BATCH)
+
+/* Pre-zeroed pages an idle cpu keeps ready for kalloc_zeroed(). */
+#define KMEM_ZERO_HIGH  64
+
+/* Number of physical page frames below PHYSTOP. */
+#define NPAGE       (PHYSTOP / PGSIZE)
+
 /* 
  * Free page's list element struct.
  * We store each free page's run structure in the free page itself.
  */
 struct run {
-    struct run *next;
+    struct run *next;       /* Link in a per-CPU cache      */
+    struct list_head list;  /* Link in a buddy free area    */
+};
+
+/*
+ * Per-CPU cache of free pages.
+ * Kernel code runs with interrupts masked and is never preempted,
+ * so a cpu may touch its own cache without taking any lock.
+ * Each cache sits on its own cache line to avoid false sharing.
+ *
+ * zero_list holds pages that are entirely zero except for the link
+ * word, which kalloc_zeroed() clears again. It is the one exception:
+ * kmem_reclaim_zero() on another cpu may take the whole pool, so the
+ * owner pushes and pops with compare-and-swap and counts with atomics.
+ */
+struct kmem_pcp {
+    struct run *free_list;
+    int nfree;
+    struct run *zero_list;
+    int nzero;
+
+    /* Statistics */
+    uint64_t alloc_hit;     /* kalloc() served from this cache      */
+    uint64_t alloc_miss;    /* kalloc() had to refill from kmem     */
+    uint64_t free_hit;      /* kfree() kept the page in this cache  */
+    uint64_t free_miss;     /* kfree() had to drain to kmem         */
+    uint64_t zero_hit;      /* kalloc_zeroed() found a zeroed page  */
+    uint64_t zero_miss;     /* kalloc_zeroed() had to clear a page  */
+} __attribute__((aligned(64)));
+
+/*
+ * Binary buddy allocator.
+ * A free block of order k is 2^k physically contiguous pages whose
+ * first page frame number is a multiple of 2^k. It is linked into
+ * area[k] and order[pfn] of its first page is k + 1. Every other
+ * page, free or not, has order[pfn] == 0.
+ */
+struct free_area {
+    struct list_head free_list;
+    int nfree;
 };
 
+/*
+ * ref[pfn] counts the page tables and kernel users of an allocated
+ * page. kalloc() sets it to 1, kdup() increments it and kfree()
+ * only frees the page when it drops to zero. It is updated with
+ * atomics, without kmem.lock.
+ */
 struct {
-    struct run *free_list; /* Free list of physical pages */
     struct spinlock lock;
+    struct free_area area[MAX_ORDER];
+    uint8_t order[NPAGE];
+    int16_t ref[NPAGE];
+    struct kmem_pcp pcp[NCPU];
 } kmem;
 
 void
 alloc_init()
 {
     initlock(&kmem.lock, "kmem");
+    for (int i = 0; i < MAX_ORDER; i++)
+        INIT_LIST_HEAD(&kmem.area[i].free_list);
     free_range(end, P2V(PHYSTOP));
 }
 
-/* Free the page of physical memory pointed at by v. */
+/*
+ * Return the block of 2^order pages starting at page frame pfn
+ * to the buddy allocator, merging it with its free buddies.
+ * Caller must hold kmem.lock.
+ */
+static void
+buddy_free(uint64_t pfn, int order)
+{
+    uint64_t buddy;
+    struct run *r;
+
+    if (kmem.order[pfn])
+        panic("buddy_free: page 0x%p is already free\n", pfn * PGSIZE);
+
+    for (; order < MAX_ORDER - 1; order++) {
+        buddy = pfn ^ (1 << order);
+        if (buddy >= NPAGE || kmem.order[buddy] != order + 1)
+            break;
+        r = (struct run *)P2V(buddy * PGSIZE);
+        list_del(&r->list);
+        kmem.area[order].nfree--;
+        kmem.order[buddy] = 0;
+        pfn &= ~(uint64_t)(1 << order);
+    }
+    r = (struct run *)P2V(pfn * PGSIZE);
+    list_add(&r->list, &kmem.area[order].free_list);
+    kmem.area[order].nfree++;
+    kmem.order[pfn] = order + 1;
+}
+
+/*
+ * Take a block of 2^order pages from the buddy allocator,
+ * splitting a larger block if needed. Returns 0 if none is left.
+ * Caller must hold kmem.lock.
+ */
+static struct run *
+buddy_alloc(int order)
+{
+    struct run *r;
+    uint64_t pfn;
+    int k;
+
+    for (k = order; k < MAX_ORDER; k++)
+        if (!list_empty(&kmem.area[k].free_list))
+            break;
+    if (k == MAX_ORDER)
+        return 0;
+
+    r = list_first_entry(&kmem.area[k].free_list, struct run, list);
+    list_del(&r->list);
+    kmem.area[k].nfree--;
+    pfn = V2P(r) / PGSIZE;
+    kmem.order[pfn] = 0;
+
+    /* Give back the upper halves until the block is small enough. */
+    while (k > order) {
+        k--;
+        struct run *half = (struct run *)P2V((pfn + (1 << k)) * PGSIZE);
+        list_add(&half->list, &kmem.area[k].free_list);
+        kmem.area[k].nfree++;
+        kmem.order[pfn + (1 << k)] = k + 1;
+    }
+    return r;
+}
+
+/* Move up to KMEM_BATCH pages from the buddy allocator into c. */
+static void
+kmem_refill(struct kmem_pcp *c)
+{
+    struct run *r;
+
+    acquire(&kmem.lock);
+    for (int i = 0; i < KMEM_BATCH && (r = buddy_alloc(0)); i++) {
+        r->next = c->free_list;
+        c->free_list = r;
+        c->nfree++;
+    }
+    release(&kmem.lock);
+}
+
+/* Give KMEM_BATCH pages of c back to the buddy allocator. */
+static void
+kmem_drain(struct kmem_pcp *c)
+{
+    struct run *r;
+
+    acquire(&kmem.lock);
+    for (int i = 0; i < KMEM_BATCH; i++) {
+        r = c->free_list;
+        c->free_list = r->next;
+        buddy_free(V2P(r) / PGSIZE, 0);
+    }
+    c->nfree -= KMEM_BATCH;
+    release(&kmem.lock);
+}
+
+/*
+ * Memory is short: take the zeroed pools of all cpus, this one's
+ * included, and free their pages. The thief only ever empties a
+ * pool, so the owner cannot see a popped page come back (no ABA).
+ */
+static void
+kmem_reclaim_zero()
+{
+    struct run *r, *next;
+    int n;
+
+    for (int i = 0; i < NCPU; i++) {
+        r = __atomic_exchange_n(&kmem.pcp[i].zero_list, 0, __ATOMIC_ACQUIRE);
+        for (n = 0; r; r = next, n++) {
+            next = r->next;
+            kfree((char *)r);
+        }
+        __atomic_sub_fetch(&kmem.pcp[i].nzero, n, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Drop a reference to the page of physical memory pointed at by v,
+ * freeing the page if it was the last one.
+ */
 void
 kfree(char *v)
 {
     struct run *r;
+    struct kmem_pcp *c;
+    int ref;
 
     if ((uint64_t)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
         panic("kfree\n");
 
+    ref = __atomic_sub_fetch(&kmem.ref[V2P(v) / PGSIZE], 1, __ATOMIC_ACQ_REL);
+    if (ref > 0)
+        return;
+    if (ref < 0)
+        panic("kfree: page 0x%p is not allocated\n", V2P(v));
+
+#ifdef KALLOC_JUNK
     /* Fill with junk to catch dangling refs. */
-    // memset(v, 1, PGSIZE);
+    memset(v, 1, PGSIZE);
+#endif
     
     /* TODO: Your code here. */
     r = (struct run *)v;
-    acquire(&kmem.lock);
-    r->next = kmem.free_list;
-    kmem.free_list = r;
-    release(&kmem.lock);
+    c = &kmem.pcp[cpuid()];
+    r->next = c->free_list;
+    c->free_list = r;
+    if (++c->nfree > KMEM_HIGH) {
+        c->free_miss++;
+        kmem_drain(c);
+    } else {
+        c->free_hit++;
+    }
 }
 
+/*
+ * Hand the pages in [vstart, vend) to the buddy allocator.
+ * The range is cut into the largest naturally aligned blocks
+ * that fit, so that freeing all of memory at boot costs a few
+ * hundred buddy_free() calls under one lock acquisition instead
+ * of a kfree() per page.
+ */
 void
 free_range(void *vstart, void *vend)
 {
-    char *p;
-    p = ROUNDUP((char *)vstart, PGSIZE);
-    for (; p + PGSIZE <= (char *)vend; p += PGSIZE)
-        kfree(p);
+    uint64_t pfn, last;
+    int order;
+
+    pfn = ROUNDUP(V2P(vstart), PGSIZE) / PGSIZE;
+    last = ROUNDDOWN(V2P(vend), PGSIZE) / PGSIZE;
+
+    acquire(&kmem.lock);
+    while (pfn < last) {
+        order = MAX_ORDER - 1;
+        while (order > 0 && ((pfn & ((1 << order) - 1)) || pfn + (1 << order) > last))
+            order--;
+        buddy_free(pfn, order);
+        pfn += 1 << order;
+    }
+    release(&kmem.lock);
 }
 
 /* 
@@ -69,27 +285,238 @@ kalloc()
 {
     /* TODO: Your code here. */
     struct run *r;
+    struct kmem_pcp *c = &kmem.pcp[cpuid()];
 
-    acquire(&kmem.lock);
-    r = kmem.free_list;
-    if (r)
-        kmem.free_list = r->next;
-    release(&kmem.lock);
+    if (c->free_list) {
+        c->alloc_hit++;
+    } else {
+        c->alloc_miss++;
+        kmem_refill(c);
+        /* Give back the zeroed pools before reporting failure. */
+        if (c->free_list == 0)
+            kmem_reclaim_zero();
+    }
+
+    r = c->free_list;
+    if (r) {
+        c->free_list = r->next;
+        c->nfree--;
+        kmem.ref[V2P(r) / PGSIZE] = 1;
+    }
     
+#ifdef KALLOC_JUNK
     if (r) /* Fill with junk */
         memset((char *)r, 5, PGSIZE);
+#endif
     
     return (char *)r;
 }
 
+/* Take another reference to the page allocated by kalloc() at v. */
+void
+kdup(char *v)
+{
+    if ((uint64_t)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+        panic("kdup\n");
+    if (__atomic_fetch_add(&kmem.ref[V2P(v) / PGSIZE], 1, __ATOMIC_ACQ_REL) <= 0)
+        panic("kdup: page 0x%p is not allocated\n", V2P(v));
+}
+
+/* Return the number of references to the page allocated by kalloc() at v. */
+int
+kref(char *v)
+{
+    return __atomic_load_n(&kmem.ref[V2P(v) / PGSIZE], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Allocate one zero-filled page, preferably from the pool of
+ * pages cleared ahead of time by kalloc_zero_fill().
+ * Returns 0 if the memory cannot be allocated.
+ */
+char *
+kalloc_zeroed()
+{
+    struct run *r;
+    struct kmem_pcp *c = &kmem.pcp[cpuid()];
+
+    r = __atomic_load_n(&c->zero_list, __ATOMIC_ACQUIRE);
+    while (r && !__atomic_compare_exchange_n(&c->zero_list, &r, r->next, 0,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        ;
+    if (r) {
+        __atomic_sub_fetch(&c->nzero, 1, __ATOMIC_RELAXED);
+        c->zero_hit++;
+        r->next = 0;
+        return (char *)r;
+    }
+
+    c->zero_miss++;
+    if ((r = (struct run *)kalloc()))
+        memset(r, 0, PGSIZE);
+    return (char *)r;
+}
+
+/*
+ * Clear one more page for this cpu's zeroed pool.
+ * Called by an idle cpu from idle(), so that the work of
+ * zeroing page tables and anonymous memory is done off the
+ * allocation path. Returns 0 once the pool is full, or when
+ * memory is short: then kalloc() would reclaim the pools again.
+ */
+int
+kalloc_zero_fill()
+{
+    struct run *r;
+    struct kmem_pcp *c = &kmem.pcp[cpuid()];
+
+    if (c->nzero >= KMEM_ZERO_HIGH)
+        return 0;
+    if (c->free_list == 0)
+        kmem_refill(c);
+    if (c->free_list == 0 || (r = (struct run *)kalloc()) == 0)
+        return 0;
+    memset(r, 0, PGSIZE);
+    r->next = __atomic_load_n(&c->zero_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&c->zero_list, &r->next, r, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    __atomic_add_fetch(&c->nzero, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * Allocate 2^order physically contiguous pages, aligned to their size.
+ * Order 0 goes through kalloc(). Returns 0 if the memory cannot be
+ * allocated.
+ */
+char *
+alloc_pages(int order)
+{
+    struct run *r;
+
+    if (order < 0 || order >= MAX_ORDER)
+        panic("alloc_pages: bad order %d\n", order);
+    if (order == 0)
+        return kalloc();
+
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
+    release(&kmem.lock);
+    return (char *)r;
+}
+
+/* Free 2^order pages previously returned by alloc_pages(order). */
+void
+free_pages(char *v, int order)
+{
+    if (order < 0 || order >= MAX_ORDER)
+        panic("free_pages: bad order %d\n", order);
+    if (order == 0) {
+        kfree(v);
+        return;
+    }
+    if (V2P(v) % ((uint64_t)PGSIZE << order) || v < end || V2P(v) >= PHYSTOP)
+        panic("free_pages\n");
+
+    acquire(&kmem.lock);
+    buddy_free(V2P(v) / PGSIZE, order);
+    release(&kmem.lock);
+}
+
+/* Number of free pages, counting those in per-CPU caches. */
+int
+kmem_nfree()
+{
+    int n = 0;
+
+    acquire(&kmem.lock);
+    for (int k = 0; k < MAX_ORDER; k++)
+        n += kmem.area[k].nfree << k;
+    release(&kmem.lock);
+    for (int i = 0; i < NCPU; i++)
+        n += kmem.pcp[i].nfree + kmem.pcp[i].nzero;
+    return n;
+}
+
+/*
+ * Allocate a zeroed table of at least *n entries of size bytes in
+ * one buddy block, for tables sized at boot. *n is set to the
+ * number of entries that fit the block, which is fewer than asked
+ * for if the largest block is too small.
+ */
+void *
+alloc_table(int *n, size_t size)
+{
+    int order = 0;
+    char *v;
+
+    while (order < MAX_ORDER - 1 && ((uint64_t)PGSIZE << order) < *n * size)
+        order++;
+    if ((v = alloc_pages(order)) == 0)
+        panic("alloc_table: out of memory\n");
+    memset(v, 0, (uint64_t)PGSIZE << order);
+    *n = ((uint64_t)PGSIZE << order) / size;
+    return v;
+}
+
 void
 check_free_list()
 {
     struct run *p;
-    if (!kmem.free_list)
-        panic("kmem.free_list is a null pointer!\n");
+    struct list_head *l;
+    int nfree = 0;
+
+    for (int k = 0; k < MAX_ORDER; k++) {
+        for (l = kmem.area[k].free_list.next; l != &kmem.area[k].free_list; l = l->next) {
+            p = list_entry(l, struct run, list);
+            assert((void *)p > (void *)end);
+            assert(V2P(p) % ((uint64_t)PGSIZE << k) == 0);
+            assert(kmem.order[V2P(p) / PGSIZE] == k + 1);
+        }
+        nfree += kmem.area[k].nfree;
+    }
+    if (nfree == 0)
+        panic("check_free_list: no free memory!\n");
+    for (int i = 0; i < NCPU; i++) {
+        for (p = kmem.pcp[i].free_list; p; p = p->next) {
+            assert((void *)p > (void *)end);
+        }
+        for (p = kmem.pcp[i].zero_list; p; p = p->next) {
+            assert((void *)p > (void *)end);
+        }
+    }
+}
+
+/* Percentage of hit out of hit + miss, for statistics. */
+static int
+percent(uint64_t hit, uint64_t miss)
+{
+    return hit + miss ? hit * 100 / (hit + miss) : 0;
+}
+
+/*
+ * Print per-CPU page cache statistics to console.
+ * Runs when user types ^K on console.
+ * No lock since the counters are only advisory.
+ */
+void
+kmem_stat()
+{
+    struct kmem_pcp *c;
+
+    cprintf("kmem: free blocks per order:");
+    for (int k = 0; k < MAX_ORDER; k++)
+        cprintf(" %d", kmem.area[k].nfree);
+    cprintf("\n");
 
-    for (p = kmem.free_list; p; p = p->next) {
-        assert((void *)p > (void *)end);
+    cprintf("kmem: cpu  cached  zeroed  alloc(hit/miss)  free(hit/miss)  zeroed(hit/miss)\n");
+    for (int i = 0; i < NCPU; i++) {
+        c = &kmem.pcp[i];
+        cprintf("kmem: %d    %d    %d    %lld/%lld (%d%%)    %lld/%lld (%d%%)    %lld/%lld (%d%%)\n",
+                i, c->nfree, c->nzero,
+                c->alloc_hit, c->alloc_miss, percent(c->alloc_hit, c->alloc_miss),
+                c->free_hit, c->free_miss, percent(c->free_hit, c->free_miss),
+                c->zero_hit, c->zero_miss, percent(c->zero_hit, c->zero_miss));
     }
 }
@@ -146,6 +146,8 @@ begin_op()
             sleep(&log, &log.lock);
         } else {
             log.outstanding += 1;
+            // Pass the wakeup on, there may be room for the next op too.
+            wakeup_one(&log);
             release(&log.lock);
             break;
         }
@@ -174,7 +176,7 @@ end_op()
         // begin_op() may be waiting for log space,
         // and decrementing log.outstanding has decreased
         // the amount of reserved space.
-        wakeup(&log);
+        wakeup_one(&log);
     }
     release(&log.lock);
 
@@ -184,7 +186,7 @@ end_op()
         commit();
         acquire(&log.lock);
         log.committing = 0;
-        wakeup(&log);
+        wakeup_one(&log);
         release(&log.lock);
     }
 }
@@ -15,6 +15,16 @@ struct cpu cpus[NCPU];
 
 volatile static int started = 0;
 
+/* Counter value when cpu0 entered main(), for boot time measurement. */
+static uint64_t boot_ts = 0;
+
+/* Microseconds elapsed since cpu0 entered main(). */
+static uint64_t
+boot_us()
+{
+    return (timestamp() - boot_ts) * 1000000 / timerfreq();
+}
+
 void
 main()
 {
@@ -24,6 +34,7 @@ main()
      */
 
     extern char edata[], end[], vectors[];
+    uint64_t t = timestamp();
 
     /*
      * Determine which functions in main can only be
@@ -35,21 +46,28 @@ main()
         /* TODO: Use `memset` to clear the BSS section of our program. */
         cprintf("main: [CPU%d] is init kernel\n", cpuid());
         memset(edata, 0, end - edata);    
+        boot_ts = t;
         console_init();
+        t = timestamp();
         alloc_init();
-        cprintf("main: allocator init success.\n");
+        cprintf("main: allocator init success in %lld us.\n",
+                (timestamp() - t) * 1000000 / timerfreq());
         check_free_list();
 
         irq_init();
         proc_init();
+        asid_init();
+        icache_init();
+        vma_init();
+        wheel_init();
 
         user_init();
-        for (int i = 0; i < 3; ++i) {
-            user_idle_init();
-        }
         
         binit();
         fileinit();
+#ifdef SYSCALL_STATS
+        sysstat_init();
+#endif
         sd_init();
 
         started = 1;
@@ -60,8 +78,13 @@ main()
     
     lvbar(vectors);
     timer_init();
+    ipi_init();
+
+#ifdef TEST_SPINLOCK
+    test_spinlock();
+#endif
 
-    cprintf("main: [CPU%d] Init success.\n", cpuid());
+    cprintf("main: [CPU%d] Init success, entering scheduler %lld us after boot.\n", cpuid(), boot_us());
 
     // if (cpuid() > 4) {
     //     while (1)
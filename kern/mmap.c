@@ -0,0 +1,418 @@
+#include <sys/mman.h>
+
+#include "types.h"
+#include "arm.h"
+#include "mmu.h"
+#include "memlayout.h"
+#include "string.h"
+#include "console.h"
+#include "kalloc.h"
+#include "slab.h"
+#include "proc.h"
+#include "file.h"
+#include "mmap.h"
+#include "defs.h"
+
+/*
+ * Memory mappings.
+ *
+ * Each process keeps its mappings on p->vmas, sorted by address
+ * and placed top-down from UADDR_SZ, well clear of the heap. No
+ * page is allocated by mmap() itself; pgfault() calls vma_fault()
+ * to fill a page on first touch, zeroed or read from the file.
+ *
+ * There is no page cache, so a file page is copied out of the
+ * buffer cache once per mapping, when it is first touched.
+ * MAP_SHARED pages are shared with children across fork() rather
+ * than copied on write. A shared file mapping may not be writable:
+ * its copy of a page would not see write() to the file, nor other
+ * mappings, and writing the page back whole would undo theirs.
+ */
+
+static struct kmem_cache vma_cache;
+
+void
+vma_init()
+{
+    kmem_cache_init(&vma_cache, "vma", sizeof(struct vma), 0);
+}
+
+/*
+ * Return the mapping of p containing va, or 0 if there is none.
+ * A vfork() child sees the mappings of the parent it borrows from.
+ */
+struct vma *
+vma_find(struct proc *p, uint64_t va)
+{
+    struct list_head *l, *vmas;
+    struct vma *v;
+
+    vmas = p->vfork ? &p->parent->vmas : &p->vmas;
+    for (l = vmas->next; l != vmas; l = l->next) {
+        v = list_entry(l, struct vma, list);
+        if (va < v->start) {
+            break;
+        }
+        if (va < v->end) {
+            return v;
+        }
+    }
+    return 0;
+}
+
+/* Does any mapping of p overlap [start, end)? */
+int
+vma_overlap(struct proc *p, uint64_t start, uint64_t end)
+{
+    struct list_head *l;
+    struct vma *v;
+
+    for (l = p->vmas.next; l != &p->vmas; l = l->next) {
+        v = list_entry(l, struct vma, list);
+        if (v->start < end && start < v->end) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Link v into p->vmas, keeping the list sorted. */
+static void
+vma_insert(struct proc *p, struct vma *v)
+{
+    struct list_head *l;
+
+    for (l = p->vmas.next; l != &p->vmas; l = l->next) {
+        if (list_entry(l, struct vma, list)->start > v->start) {
+            break;
+        }
+    }
+    list_add_tail(&v->list, l);
+}
+
+/*
+ * Find the highest free range of len bytes between the heap and
+ * UADDR_SZ. Returns its start, or 0 if there is no room.
+ */
+static uint64_t
+vma_gap(struct proc *p, uint64_t len)
+{
+    struct list_head *l;
+    struct vma *v;
+    uint64_t hi = UADDR_SZ, lo = ROUNDUP(p->sz, PGSIZE);
+
+    for (l = p->vmas.prev; l != &p->vmas; l = l->prev) {
+        v = list_entry(l, struct vma, list);
+        if (hi - v->end >= len) {
+            return hi - len;
+        }
+        hi = v->start;
+    }
+    if (hi >= lo + len) {
+        return hi - len;
+    }
+    return 0;
+}
+
+/*
+ * Map len bytes of f at offset off, or anonymous memory if f is
+ * null, into the current process. Honours addr only with
+ * MAP_FIXED. Returns the address of the mapping or -1.
+ */
+uint64_t
+vma_map(uint64_t addr, uint64_t len, int prot, int flags, struct file *f, uint64_t off)
+{
+    struct proc *p = thisproc();
+    struct vma *v;
+    int type = flags & MAP_TYPE;
+
+    if (p->vfork || len == 0 || len >= UADDR_SZ || off % PGSIZE != 0) {
+        return -1;
+    }
+    if (type != MAP_SHARED && type != MAP_PRIVATE) {
+        return -1;
+    }
+    len = ROUNDUP(len, PGSIZE);
+    if (flags & MAP_ANONYMOUS) {
+        f = 0;
+        off = 0;
+    } else {
+        if (f == 0 || f->type != FD_INODE || f->ip->type != T_FILE || !f->readable) {
+            return -1;
+        }
+        if (type == MAP_SHARED && (prot & PROT_WRITE)) {
+            return -1;
+        }
+    }
+
+    if (flags & MAP_FIXED) {
+        if (addr % PGSIZE != 0 || addr < ROUNDUP(p->sz, PGSIZE) ||
+            addr + len > UADDR_SZ) {
+            return -1;
+        }
+        if (vma_unmap(addr, len) < 0) {
+            return -1;
+        }
+    } else if ((addr = vma_gap(p, len)) == 0) {
+        return -1;
+    }
+
+    if ((v = kmem_cache_alloc(&vma_cache)) == 0) {
+        return -1;
+    }
+    v->start = addr;
+    v->end = addr + len;
+    v->prot = prot;
+    v->flags = flags;
+    v->file = f ? filedup(f) : 0;
+    v->off = off;
+    vma_insert(p, v);
+    return addr;
+}
+
+/*
+ * Remove [addr, addr+len) from the mappings of the current process,
+ * splitting any mapping that straddles the range. Returns 0, or -1
+ * if the arguments are bad or a split ran out of memory.
+ */
+int
+vma_unmap(uint64_t addr, uint64_t len)
+{
+    struct proc *p = thisproc();
+    struct list_head *l, *next;
+    struct vma *v, *w;
+    uint64_t end, lo, hi;
+
+    if (p->vfork || addr % PGSIZE != 0 || len == 0 || len >= UADDR_SZ) {
+        return -1;
+    }
+    end = addr + ROUNDUP(len, PGSIZE);
+
+    for (l = p->vmas.next; l != &p->vmas; l = next) {
+        next = l->next;
+        v = list_entry(l, struct vma, list);
+        if (v->end <= addr || v->start >= end) {
+            continue;
+        }
+        lo = MAX(v->start, addr);
+        hi = MIN(v->end, end);
+        if (v->start < lo && hi < v->end) {
+            /* Punching a hole, keep [hi, v->end) as a mapping of its own. */
+            if ((w = kmem_cache_alloc(&vma_cache)) == 0) {
+                return -1;
+            }
+            *w = *v;
+            w->start = hi;
+            w->off += hi - v->start;
+            if (w->file) {
+                filedup(w->file);
+            }
+            list_add(&w->list, &v->list);
+        }
+
+        uvm_dealloc(p->pgdir, hi, lo);
+
+        if (lo == v->start && hi == v->end) {
+            list_del(&v->list);
+            if (v->file) {
+                fileclose(v->file);
+            }
+            kmem_cache_free(&vma_cache, v);
+        } else if (lo == v->start) {
+            v->off += hi - v->start;
+            v->start = hi;
+        } else {
+            v->end = lo;
+        }
+    }
+    tlbi_asid(ASID(p->asid));
+    return 0;
+}
+
+/*
+ * Drop the pages of [addr, addr+len) in the current process, for
+ * madvise(MADV_DONTNEED). Heap and stack pages come back zeroed on
+ * the next touch, mapped ones zeroed or read again from the file.
+ * Shared anonymous pages are the only copy of their data and are
+ * kept. Returns 0, or -1 if part of the range is below the stack
+ * or not mapped at all.
+ */
+int
+vma_dontneed(uint64_t addr, uint64_t len)
+{
+    struct proc *p = thisproc();
+    struct list_head *l;
+    struct vma *v;
+    uint64_t end, va;
+
+    if (p->vfork || addr % PGSIZE != 0 || len >= UADDR_SZ) {
+        return -1;
+    }
+    end = addr + ROUNDUP(len, PGSIZE);
+    if (addr < p->ustack || end > UADDR_SZ) {
+        return -1;
+    }
+
+    /* Check that mappings cover all of the range above the heap. */
+    va = MAX(addr, ROUNDUP(p->sz, PGSIZE));
+    for (l = p->vmas.next; l != &p->vmas && va < end; l = l->next) {
+        v = list_entry(l, struct vma, list);
+        if (v->end <= va) {
+            continue;
+        }
+        if (v->start > va) {
+            break;
+        }
+        va = v->end;
+    }
+    if (va < end) {
+        return -1;
+    }
+
+    if (addr < p->sz) {
+        uvm_dealloc(p->pgdir, MIN(end, p->sz), addr);
+    }
+    for (l = p->vmas.next; l != &p->vmas; l = l->next) {
+        v = list_entry(l, struct vma, list);
+        if (v->end <= addr || v->start >= end ||
+            (v->file == 0 && (v->flags & MAP_SHARED))) {
+            continue;
+        }
+        uvm_dealloc(p->pgdir, MIN(v->end, end), MAX(v->start, addr));
+    }
+    tlbi_asid(ASID(p->asid));
+    return 0;
+}
+
+/*
+ * Resolve a fault at va above the heap of p, write if the access
+ * was a write. Returns 0 if the access can be retried.
+ */
+int
+vma_fault(struct proc *p, uint64_t va, int write)
+{
+    struct vma *v;
+    uint64_t *pte, off;
+    int64_t perm;
+    char *mem;
+    int n;
+
+    if ((v = vma_find(p, va)) == 0 || v->prot == PROT_NONE) {
+        return -1;
+    }
+    if (write && !(v->prot & PROT_WRITE)) {
+        return -1;
+    }
+    va = ROUNDDOWN(va, PGSIZE);
+
+    pte = pgdir_walk(p->pgdir, (void *)va, 0);
+    if (pte && (*pte & PTE_P)) {
+        /* A write to a private page that is mapped read-only. */
+        if (!write || !(*pte & PTE_COW) || uvm_cow(p->pgdir, va) < 0) {
+            return -1;
+        }
+        p->ru.minflt++;
+        return 0;
+    }
+
+    perm = PTE_USER | ((v->prot & PROT_WRITE) ? PTE_RW : PTE_RO);
+    if (v->file == 0) {
+        if ((mem = kalloc_zeroed()) == 0) {
+            return -1;
+        }
+    } else {
+        if ((mem = kalloc()) == 0) {
+            return -1;
+        }
+        off = v->off + (va - v->start);
+        ilock(v->file->ip);
+        n = off < v->file->ip->size ? readi(v->file->ip, mem, off, PGSIZE) : 0;
+        iunlock(v->file->ip);
+        memset(mem + MAX(n, 0), 0, PGSIZE - MAX(n, 0));
+    }
+    if (uvm_map(p->pgdir, va, mem, perm) < 0) {
+        kfree(mem);
+        return -1;
+    }
+    if (v->file) {
+        p->ru.majflt++;
+    } else {
+        p->ru.minflt++;
+    }
+    return 0;
+}
+
+/*
+ * Check that [addr, addr+len) lies within one mapping of p that
+ * allows reading it, or writing it if write is set, and fault its
+ * pages in now, writable if need be. System calls use this for
+ * user buffers, so that touching them later neither faults in a
+ * way the mapping forbids nor sleeps on an inode while the kernel
+ * holds locks of its own.
+ */
+int
+vma_access(struct proc *p, uint64_t addr, uint64_t len, int write)
+{
+    struct vma *v;
+    uint64_t va, *pte;
+
+    if ((v = vma_find(p, addr)) == 0 || addr + len > v->end || addr + len < addr) {
+        return -1;
+    }
+    if (!(v->prot & (write ? PROT_WRITE : PROT_READ))) {
+        return -1;
+    }
+    for (va = ROUNDDOWN(addr, PGSIZE); va < addr + len; va += PGSIZE) {
+        pte = pgdir_walk(p->pgdir, (void *)va, 0);
+        if ((pte == 0 || (*pte & PTE_P) == 0 || (write && (*pte & PTE_RO))) &&
+            vma_fault(p, va, write) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Give child copies of the mappings of parent. Private pages are
+ * shared copy-on-write, MAP_SHARED pages are simply shared.
+ * The caller must flush the TLB entries of parent.
+ */
+int
+vma_copy(struct proc *parent, struct proc *child)
+{
+    struct list_head *l;
+    struct vma *v, *w;
+
+    for (l = parent->vmas.next; l != &parent->vmas; l = l->next) {
+        v = list_entry(l, struct vma, list);
+        if ((w = kmem_cache_alloc(&vma_cache)) == 0) {
+            return -1;
+        }
+        *w = *v;
+        if (w->file) {
+            filedup(w->file);
+        }
+        list_add_tail(&w->list, &child->vmas);
+        if (uvm_copy(parent->pgdir, child->pgdir, v->start, v->end,
+                     v->flags & MAP_SHARED) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Drop all mappings of p. The pages themselves go with p->pgdir. */
+void
+vma_release(struct proc *p)
+{
+    struct vma *v;
+
+    while (!list_empty(&p->vmas)) {
+        v = list_first_entry(&p->vmas, struct vma, list);
+        list_del(&v->list);
+        if (v->file) {
+            fileclose(v->file);
+        }
+        kmem_cache_free(&vma_cache, v);
+    }
+}
@@ -1,16 +1,44 @@
 #include "proc.h"
+#include "arm.h"
 #include "spinlock.h"
 #include "console.h"
 #include "kalloc.h"
 #include "trap.h"
+#include "timer.h"
 #include "string.h"
 #include "mmu.h"
 #include "fs.h"
 #include "defs.h"
 
+/*
+ * Sleeping processes wait on one of NSLEEPQ queues, picked by
+ * hashing their chan, so that wakeup() only looks at processes
+ * that may be sleeping on it. Queues are FIFO, wakeup_one() wakes
+ * the process that has waited longest.
+ */
+#define NSLEEPQ         64
+#define SLEEPQ(chan)    (&ptable.sleepq[(((uint64_t)(chan) >> 3) ^ ((uint64_t)(chan) >> 9)) % NSLEEPQ])
+
+/*
+ * The process table is sized at boot from free memory, see
+ * proc_init(). Live processes are also found by pid through a
+ * hash table of about half as many buckets, and UNUSED ones sit
+ * on a free list, so neither lookup nor fork and exit get slower
+ * as the table grows. The hash chains change under ptable.pidseq
+ * as well, so that reading an attribute of a process by pid can
+ * leave ptable.lock alone, see peekproc().
+ */
+#define PIDHASH(pid)    (&ptable.pidhash[(pid) % ptable.npidhash])
+
 struct {
-    struct proc proc[NPROC];
+    struct proc *proc;
+    int nproc;
     struct spinlock lock;
+    struct list_head sleepq[NSLEEPQ];
+    struct list_head *pidhash;
+    int npidhash;
+    struct seqlock pidseq;
+    struct list_head free;
 } ptable;
 
 static struct proc *initproc;
@@ -20,7 +48,8 @@ void forkret();
 extern void trapret();
 void swtch(struct context **, struct context *);
 
-static void wakeup1(void *chan);
+static void wakeup1(void *chan, int one);
+static void sleep_expire(void *);
 
 /*
  * Initialize the spinlock for ptable to serialize the access to ptable
@@ -30,6 +59,262 @@ proc_init()
 {
     /* TODO: Your code here. */
     initlock(&ptable.lock, "ptable");
+    initseqlock(&ptable.pidseq, "pidhash");
+    for (int i = 0; i < NSLEEPQ; i++) {
+        INIT_LIST_HEAD(&ptable.sleepq[i]);
+    }
+    ptable.nproc = MAX(NPROC, kmem_nfree() / PROC_PAGES);
+    ptable.proc = alloc_table(&ptable.nproc, sizeof(struct proc));
+    ptable.npidhash = ptable.nproc / 2;
+    ptable.pidhash = alloc_table(&ptable.npidhash, sizeof(struct list_head));
+    for (int i = 0; i < ptable.npidhash; i++) {
+        INIT_LIST_HEAD(&ptable.pidhash[i]);
+    }
+    INIT_LIST_HEAD(&ptable.free);
+    for (struct proc *p = ptable.proc; p < &ptable.proc[ptable.nproc]; p++) {
+        list_add_tail(&p->sibling, &ptable.free);
+    }
+    cprintf("proc_init: %d process slots\n", ptable.nproc);
+    for (int c = 0; c < NCPU; c++) {
+        initlock(&cpus[c].rq.lock, "runqueue");
+        for (int pri = 0; pri < NPRIO; pri++) {
+            INIT_LIST_HEAD(&cpus[c].rq.queue[pri]);
+        }
+    }
+}
+
+/*
+ * Run queues.
+ *
+ * A cpu looking for work picks in O(1) from its own queue, under
+ * that queue's lock alone. A cpu with an empty queue steals from
+ * the busiest queue that holds a process it is allowed to run.
+ *
+ * A process becomes RUNNABLE under ptable.lock, but stops being
+ * RUNNABLE when a cpu takes it off its queue, under that queue's
+ * lock alone. Code holding ptable.lock that finds a process
+ * RUNNABLE must check again under the queue lock before touching
+ * its queue.
+ *
+ * The scheduler does not take ptable.lock to pick, so picks on
+ * different cpus do not serialize. A process calls sched() with
+ * ptable.lock held, and the cpu it leaves drops it once swtch()
+ * has saved its context; until then on_cpu stays set, and a cpu
+ * that already took the process from a queue waits for it.
+ */
+
+#define ALLOWED(p, c) (((p)->cpus_allowed >> (c)) & 1)
+
+/*
+ * Highest level p may be at. A positive nice value keeps p
+ * that many twentieths of the way down from the top level.
+ */
+#define TOPPRIO(p) ((p)->nice > 0 ? NPRIO - 1 - ((p)->nice * (NPRIO - 1) + 19) / 20 : NPRIO - 1)
+
+/* Highest level set in a non-zero queue bitmap. */
+#define TOPBIT(bits) (31 - __builtin_clz(bits))
+
+static const int quantum[NPRIO] = QUANTA;
+
+/* Link p into rq at its priority. rq->lock must be held. */
+static void
+rq_link(struct runqueue *rq, struct proc *p)
+{
+    list_add_tail(&p->rq_node, &rq->queue[p->priority]);
+    rq->bitmap |= 1U << p->priority;
+    rq->nr++;
+    for (int c = 0; c < NCPU; c++) {
+        rq->nallow[c] += ALLOWED(p, c);
+    }
+}
+
+/* Unlink p from rq. rq->lock must be held. */
+static void
+rq_unlink(struct runqueue *rq, struct proc *p)
+{
+    list_del(&p->rq_node);
+    if (list_empty(&rq->queue[p->priority])) {
+        rq->bitmap &= ~(1U << p->priority);
+    }
+    rq->nr--;
+    for (int c = 0; c < NCPU; c++) {
+        rq->nallow[c] -= ALLOWED(p, c);
+    }
+}
+
+/* Queue p on the run queue of cpu c. */
+static void
+rq_add(struct proc *p, int c)
+{
+    struct runqueue *rq = &cpus[c].rq;
+
+    acquire(&rq->lock);
+    rq_link(rq, p);
+    p->cpu = c;
+    release(&rq->lock);
+}
+
+/*
+ * Take the first process off rq, highest priority first, that
+ * cpu c may run, and mark it RUNNING on c. Returns 0 if there is
+ * none. On a cpu's own queue the first one found is always
+ * allowed, so this is O(1).
+ */
+static struct proc *
+rq_take(struct runqueue *rq, int c)
+{
+    struct list_head *l;
+    struct proc *p;
+    uint32_t bits;
+    int pri;
+
+    if (rq->nr == 0) {
+        return 0;
+    }
+    acquire(&rq->lock);
+    for (bits = rq->bitmap; bits; bits &= ~(1U << pri)) {
+        pri = TOPBIT(bits);
+        for (l = rq->queue[pri].next; l != &rq->queue[pri]; l = l->next) {
+            p = list_entry(l, struct proc, rq_node);
+            if (ALLOWED(p, c)) {
+                rq_unlink(rq, p);
+                p->state = RUNNING;
+                p->cpu = c;
+                release(&rq->lock);
+                return p;
+            }
+        }
+    }
+    release(&rq->lock);
+    return 0;
+}
+
+/*
+ * Move p to priority pri with a fresh quantum, requeueing it if
+ * it is waiting to run. Caller must hold ptable.lock.
+ */
+static void
+set_priority(struct proc *p, int pri)
+{
+    struct runqueue *rq;
+
+    if (p->state == RUNNABLE) {
+        rq = &cpus[p->cpu].rq;
+        acquire(&rq->lock);
+        if (p->state == RUNNABLE) {
+            rq_unlink(rq, p);
+            p->priority = pri;
+            rq_link(rq, p);
+        } else {
+            p->priority = pri;
+        }
+        release(&rq->lock);
+    } else {
+        p->priority = pri;
+    }
+    p->ticks = 0;
+}
+
+/*
+ * The cpu other than me whose run queue holds the most processes
+ * me may run, or -1 if none holds any. Queues of processes pinned
+ * elsewhere do not count, or me would keep taking ptable.lock to
+ * steal what it cannot run.
+ */
+static int
+rq_busiest(int me)
+{
+    int c, best = -1;
+
+    for (c = 0; c < NCPU; c++) {
+        if (c != me && cpus[c].rq.nallow[me] > 0 &&
+            (best < 0 || cpus[c].rq.nallow[me] > cpus[best].rq.nallow[me])) {
+            best = c;
+        }
+    }
+    return best;
+}
+
+/*
+ * Make p RUNNABLE and queue it on the cpu it last ran on if that
+ * one is idle, else on any idle cpu, else on the last one again,
+ * else on the least loaded cpu, all among those p may run on.
+ * An idle cpu is woken up with an IPI.
+ * Caller must hold ptable.lock.
+ */
+static void
+make_runnable(struct proc *p)
+{
+    int c, best = -1;
+
+    if (!holding(&ptable.lock)) {
+        panic("make_runnable: not holding ptable lock\n");
+    }
+    p->state = RUNNABLE;
+    p->queued = timestamp();
+    if (p->cpu >= 0 && ALLOWED(p, p->cpu) && cpus[p->cpu].idle) {
+        best = p->cpu;
+    }
+    for (c = 0; c < NCPU && best < 0; c++) {
+        if (ALLOWED(p, c) && cpus[c].idle) {
+            best = c;
+        }
+    }
+    if (best < 0 && p->cpu >= 0 && ALLOWED(p, p->cpu)) {
+        best = p->cpu;
+    }
+    if (best < 0) {
+        for (c = 0; c < NCPU; c++) {
+            if (ALLOWED(p, c) && (best < 0 || cpus[c].rq.nr < cpus[best].rq.nr)) {
+                best = c;
+            }
+        }
+    }
+    if (best < 0) {
+        panic("make_runnable: pid %d may run on no cpu\n", p->pid);
+    }
+    rq_add(p, best);
+
+    /* Pairs with the barrier in idle(), one of us sees the other. */
+    __sync_synchronize();
+    if (cpus[best].idle && best != cpuid()) {
+        ipi_send(best);
+    }
+}
+
+/*
+ * Is anything queued that cpu me may run? Processes pinned to other
+ * cpus do not count, they must not keep me out of wfi().
+ */
+static int
+have_work(int me)
+{
+    return cpus[me].rq.nallow[me] > 0 || rq_busiest(me) >= 0;
+}
+
+/*
+ * Nothing to run on this cpu: fill its pool of zeroed pages, then
+ * stop its tick and sleep in wfi() until an interrupt comes, most
+ * likely an IPI from make_runnable(). Interrupts are opened
+ * briefly afterwards to take the pending one.
+ */
+static void
+idle(int me)
+{
+    struct cpu *c = &cpus[me];
+
+    while (!have_work(me) && kalloc_zero_fill())
+        ;
+
+    c->idle = 1;
+    __sync_synchronize();
+    if (!have_work(me)) {
+        timer_stop();
+        wfi();
+    }
+    c->idle = 0;
+    sti();
+    cli();
 }
 
 /*
@@ -44,27 +329,32 @@ proc_alloc()
     struct proc *p;
     /* TODO: Your code here. */
     char *sp;
-    int found = 0;
     acquire(&ptable.lock);
 
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
-        if (p->state == UNUSED) {
-            found = 1;
-            break;
-        }
-    }
-
-    if (!found) {
+    if (list_empty(&ptable.free)) {
         release(&ptable.lock);
         return 0;
     }
     else {
+        p = list_first_entry(&ptable.free, struct proc, sibling);
+        list_del(&p->sibling);
+
         /* Alloc kernel stack. */
         if ((p->kstack = kalloc()) == 0) {
             release(&ptable.lock);
             panic("proc_alloc: cannot alloc kstack.\n");
         }
         p->sz = PGSIZE;
+        p->asid = 0;
+        p->vfork = 0;
+        INIT_LIST_HEAD(&p->vmas);
+        INIT_LIST_HEAD(&p->children);
+        p->xstate = 0;
+        ktimer_init(&p->timer, sleep_expire, p);
+        p->nswitch = 0;
+        p->wait = 0;
+        memset(&p->ru, 0, sizeof(p->ru));
+        memset(&p->cru, 0, sizeof(p->cru));
 
         sp = p->kstack + KSTACKSIZE;
         
@@ -88,8 +378,14 @@ proc_alloc()
 
         p->state = EMBRYO;
         p->pid = nextpid++;
-        p->priority = 0;
-        p->cpus_allowed = ~0;
+        acquireseq(&ptable.pidseq);
+        list_add(&p->pid_node, PIDHASH(p->pid));
+        releaseseq(&ptable.pidseq);
+        p->priority = NPRIO - 1;
+        p->ticks = 0;
+        p->cpus_allowed = ALLCPUS;
+        p->nice = 0;
+        p->cpu = -1;
 
         release(&ptable.lock);
     }
@@ -97,6 +393,22 @@ proc_alloc()
     return p;
 }
 
+/*
+ * Return p to the free list, its pid to nobody.
+ * Caller must hold ptable.lock.
+ */
+static void
+proc_free(struct proc *p)
+{
+    /* Not list_del(), a peekproc() walking by may still follow p. */
+    acquireseq(&ptable.pidseq);
+    __list_del(p->pid_node.prev, p->pid_node.next);
+    p->pid = 0;
+    p->state = UNUSED;
+    releaseseq(&ptable.pidseq);
+    list_add(&p->sibling, &ptable.free);
+}
+
 /*
  * Set up first user process(Only used once).
  * Set trapframe for the new process to run
@@ -124,10 +436,12 @@ user_init()
     p->tf->sp = PGSIZE;
     p->tf->elr = 0;
 
-    p->state = RUNNABLE;
+    acquire(&ptable.lock);
+    make_runnable(p);
+    release(&ptable.lock);
 
     p->cwd = namei("/");
-    p->sz = PGSIZE;
+    p->sz = p->ustack = p->heap = PGSIZE;
 }
 
 /*
@@ -144,37 +458,52 @@ scheduler()
 {
     struct proc *p;
     struct cpu *c = thiscpu;
+    int me = cpuid(), victim;
     c->proc = NULL;
 
-    int ran;
-
     for (;;) {
-        /* Loop over process table looking for process to run. */
-        /* TODO: Your code here. */
+        /*
+         * Peek at the queues without locks. With nothing to run,
+         * idle() prepares zeroed pages and sleeps once the pool
+         * is full.
+         */
+        victim = -1;
+        if (c->rq.nr == 0 && (victim = rq_busiest(me)) < 0) {
+            idle(me);
+            continue;
+        }
 
-        ran = 0;
-        acquire(&ptable.lock);
-#ifdef PRINT_TRACE
-        cprintf("scheduler: cpu%d acquired ptable lock\n", cpuid());
-#endif
-        for (int pri = 1; pri >= 0 && !ran; --pri) {
-            for (p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
-                if (p->state == RUNNABLE && p->priority == pri && ((p->cpus_allowed >> cpuid()) & 1)) {
+        p = rq_take(&c->rq, me);
+        if (p == 0 && victim >= 0) {
+            p = rq_take(&cpus[victim].rq, me);
+        }
+        if (p == 0) {
+            /* Another cpu got there first. */
+            continue;
+        }
 #ifdef PRINT_TRACE
-                    cprintf("scheduler: cpu%d running pid %d\n", cpuid(), p->pid);
+        cprintf("scheduler: cpu%d running pid %d\n", cpuid(), p->pid);
 #endif
-                    c->proc = p;
-                    uvm_switch(p);
-                    p->state = RUNNING;
-                    swtch(&c->scheduler, p->context);
-                    c->proc = NULL;
-
-                    ran = 1;
-                    break;
-                }
-            }
+        /*
+         * A process that yields is queued before it is off its
+         * cpu. Wait until that cpu has saved its context.
+         */
+        while (__atomic_load_n(&p->on_cpu, __ATOMIC_ACQUIRE)) {
+            asm volatile("yield" : : : "memory");
         }
-
+        p->on_cpu = 1;
+        p->nswitch++;
+        p->wait += timestamp() - p->queued;
+        c->proc = p;
+        timer_start();
+        uvm_switch(p);
+        p->stamp = timestamp();
+        swtch(&c->scheduler, p->context);
+        charge(0);
+        c->proc = NULL;
+
+        /* p is off this cpu now, release the lock it called sched() with. */
+        __atomic_store_n(&p->on_cpu, 0, __ATOMIC_RELEASE);
 #ifdef PRINT_TRACE
         cprintf("scheduler: cpu%d released ptable lock\n", cpuid());
 #endif
@@ -183,7 +512,9 @@ scheduler()
 }
 
 /*
- * Enter scheduler.  Must hold only ptable.lock
+ * Enter scheduler.  Must hold only ptable.lock, which keeps p from
+ * being woken up before its context is saved. The scheduler drops
+ * it then, so that sched() returns without it.
  */
 void
 sched()
@@ -207,8 +538,6 @@ void
 forkret()
 {
     /* TODO: Your code here. */
-    release(&ptable.lock);
-
     if (thiscpu->proc->pid == 1) {
         // Some initialization functions must be run in the context
         // of a regular process (e.g., they call sleep), and thus cannot
@@ -218,12 +547,13 @@ forkret()
 
 // #ifdef TEST_FILE_SYSTEM
         raise_priority();
-        set_cpus_allowed(~0 ^ 1);       // Don't run on CPU0.
+        set_cpus_allowed(0, ALLCPUS ^ 1);   // Don't run on CPU0.
         cprintf("-------------- start fs_test --------------\n");
         test_file_system();
         cprintf("-------------- end fs_test --------------\n");
 // #endif
     }
+    charge(0);
 }
 
 /*
@@ -240,6 +570,9 @@ exit()
     if (thiscpu->proc == initproc)
         panic("init exiting");
 
+    // Drop the mappings, the pages go with the pgdir.
+    vma_release(thisproc());
+
     // Close all open files.
     for (fd = 0; fd < NOFILE; fd++) {
         if (thisproc()->ofile[fd]) {
@@ -255,18 +588,30 @@ exit()
 
     acquire(&ptable.lock);
 
+    // A vfork() parent sleeps until we stop using its pgdir.
+    if (thisproc()->vfork) {
+        thisproc()->vfork = 0;
+        thisproc()->pgdir = 0;
+        wakeup1(thisproc(), 0);
+    }
+
     // Parent might be sleeping in wait().
-    wakeup1(thiscpu->proc->parent);
+    wakeup1(thiscpu->proc->parent, 0);
 
     // Pass abandoned children to init.
-    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-        if (p->parent == thisproc()) {
-            p->parent = initproc;
-            if (p->state == ZOMBIE)
-                wakeup1(initproc);
-        }
+    while (!list_empty(&thisproc()->children)) {
+        p = list_first_entry(&thisproc()->children, struct proc, sibling);
+        list_del(&p->sibling);
+        list_add_tail(&p->sibling, &initproc->children);
+        p->parent = initproc;
+        if (p->state == ZOMBIE)
+            wakeup1(initproc, 0);
     }
 
+    // Report a killed process as if killed by SIGKILL.
+    if (thisproc()->killed)
+        thisproc()->xstate = 9;
+
     // Jump into the scheduler, never to return.
     thiscpu->proc->state = ZOMBIE;
     sched();
@@ -284,12 +629,19 @@ yield()
 #ifdef PRINT_TRACE
     cprintf("yield: cpu %d, pid %d acquired ptable lock\n", cpuid(), p->pid);
 #endif
-    p->state = RUNNABLE;
+    make_runnable(p);
     sched();
-    release(&ptable.lock);
-#ifdef PRINT_TRACE
-    cprintf("yield: cpu %d, pid %d released ptable lock\n", cpuid(), p->pid);
-#endif
+}
+
+/*
+ * Take the cpu away from the current process, because its quantum
+ * is used up or a higher priority process is waiting.
+ */
+void
+preempt()
+{
+    thiscpu->proc->ru.nivcsw++;
+    yield();
 }
 
 /*
@@ -318,35 +670,84 @@ sleep(void *chan, struct spinlock *lk)
 #endif
     p->chan = chan;
     p->state = SLEEPING;
+    p->ru.nvcsw++;
+    list_add_tail(&p->sleep_node, SLEEPQ(chan));
     sched();
 #ifdef PRINT_TRACE
     cprintf("sleep: cpu%d, pid %d returned from sleep\n", cpuid(), p->pid);
 #endif
     p->chan = 0;
-#ifdef PRINT_TRACE
-    cprintf("sleep: releasing ptable lock and acquiring sdlock...");
-#endif
-    if (lk != &ptable.lock) {
-        release(&ptable.lock);
-        acquire(lk);
+    acquire(lk);
+}
+
+/*
+ * The deadline of sleep_timeout() has passed. A late expiry may
+ * hit a later sleep of p, which is only a spurious wakeup.
+ */
+static void
+sleep_expire(void *arg)
+{
+    struct proc *p = arg;
+
+    acquire(&ptable.lock);
+    if (p->state == SLEEPING) {
+        list_del(&p->sleep_node);
+        make_runnable(p);
     }
-#ifdef PRINT_TRACE
-    cprintf("Success!\n");
-#endif
+    release(&ptable.lock);
+}
+
+/*
+ * Like sleep(), but give up once the system counter reaches
+ * deadline. Returns 0 if woken up before that, -1 on timeout.
+ */
+int
+sleep_timeout(void *chan, struct spinlock *lk, uint64_t deadline)
+{
+    struct proc *p = thiscpu->proc;
+
+    ktimer_add(&p->timer, deadline);
+    sleep(chan, lk);
+    return ktimer_del(&p->timer) ? 0 : -1;
 }
 
 /*
- * Wake up all processes sleeping on chan.
+ * Sleep until the system counter reaches deadline, for
+ * nanosleep(). Returns -1 if the process got killed meanwhile.
+ */
+int
+sleep_until(uint64_t deadline)
+{
+    struct proc *p = thiscpu->proc;
+
+    acquire(&ptable.lock);
+    while (timestamp() < deadline && !p->killed) {
+        sleep_timeout(&p->timer, &ptable.lock, deadline);
+    }
+    release(&ptable.lock);
+    return p->killed ? -1 : 0;
+}
+
+/*
+ * Wake up all processes sleeping on chan, or only the one that
+ * has slept longest if one is set.
  * The ptable lock must be held.
  */
 static void
-wakeup1(void *chan)
+wakeup1(void *chan, int one)
 {
+    struct list_head *q = SLEEPQ(chan), *l, *next;
     struct proc *p;
 
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; ++p) {
-        if (p->state == SLEEPING && p->chan == chan) {
-            p->state = RUNNABLE;
+    for (l = q->next; l != q; l = next) {
+        next = l->next;
+        p = list_entry(l, struct proc, sleep_node);
+        if (p->chan == chan) {
+            list_del(&p->sleep_node);
+            make_runnable(p);
+            if (one) {
+                break;
+            }
         }
     }
 }
@@ -357,7 +758,20 @@ wakeup(void *chan)
 {
     /* TODO: Your code here. */
     acquire(&ptable.lock);
-    wakeup1(chan);
+    wakeup1(chan, 0);
+    release(&ptable.lock);
+}
+
+/*
+ * Wake up only the process that has slept longest on chan. For
+ * sleepers of which only one can go on anyway, e.g. waiting for
+ * a sleeplock, this saves waking the rest to sleep again.
+ */
+void
+wakeup_one(void *chan)
+{
+    acquire(&ptable.lock);
+    wakeup1(chan, 1);
     release(&ptable.lock);
 }
 
@@ -370,9 +784,7 @@ drop_priority()
 {
     struct proc *p = thiscpu->proc;
     acquire(&ptable.lock);
-    if (p->priority > 0) {
-        p->priority--;
-    }
+    set_priority(p, p->priority > 0 ? p->priority - 1 : 0);
     release(&ptable.lock);
 }
 
@@ -384,22 +796,215 @@ raise_priority()
 {
     struct proc *p = thiscpu->proc;
     acquire(&ptable.lock);
-    if (p->priority < 1) {
-        p->priority++;
-    }
+    set_priority(p, p->priority < TOPPRIO(p) ? p->priority + 1 : p->priority);
     release(&ptable.lock);
 }
 
-/* 
- * Set cpus_allowed mask
+/*
+ * Charge a timer tick to the current process. Returns 1 if that
+ * used up its quantum, in which case it has been moved a level
+ * down and should yield.
  */
-void
-set_cpus_allowed(int mask)
+int
+sched_tick()
+{
+    struct proc *p = thiscpu->proc;
+
+    if (++p->ticks < quantum[p->priority]) {
+        return 0;
+    }
+    drop_priority();
+    return 1;
+}
+
+/*
+ * Should the current process give way? True if a process of
+ * higher priority is waiting on this cpu. Reads without locks.
+ */
+int
+need_resched()
 {
     struct proc *p = thiscpu->proc;
+    uint32_t bits = thiscpu->rq.bitmap;
+
+    return p && bits && TOPBIT(bits) > p->priority;
+}
+
+/*
+ * Put every process back at the top level, so that CPU-bound ones
+ * sunk to the bottom are not starved by a stream of interactive
+ * ones. Called by clock() every BOOST_SECS seconds.
+ */
+void
+priority_boost()
+{
+    struct proc *p;
+
     acquire(&ptable.lock);
-    p->cpus_allowed = mask;
+    for (p = ptable.proc; p < &ptable.proc[ptable.nproc]; p++) {
+        if (p->state != UNUSED && p->state != ZOMBIE) {
+            set_priority(p, TOPPRIO(p));
+        }
+    }
+    release(&ptable.lock);
+}
+
+/*
+ * The live process with the given pid, the current one if pid
+ * is 0, or null. Caller must hold ptable.lock.
+ */
+static struct proc *
+findproc(int pid)
+{
+    struct proc *p;
+
+    struct list_head *l;
+
+    if (pid == 0) {
+        return thiscpu->proc;
+    }
+    for (l = PIDHASH(pid)->next; l != PIDHASH(pid); l = l->next) {
+        p = list_entry(l, struct proc, pid_node);
+        if (p->pid == pid) {
+            return p->state == ZOMBIE ? 0 : p;
+        }
+    }
+    return 0;
+}
+
+/*
+ * findproc() without ptable.lock, for a read started with
+ * readseqbegin(&ptable.pidseq) = s. Procs are never freed, so a
+ * walk racing with fork() or exit() only follows stale links and
+ * gives up; the caller retries when readseqretry() says so.
+ */
+static struct proc *
+peekproc(int pid, uint32_t s)
+{
+    struct list_head *l;
+    struct proc *p;
+
+    if (pid == 0) {
+        return thiscpu->proc;
+    }
+    for (l = PIDHASH(pid)->next; l != PIDHASH(pid); l = l->next) {
+        if (readseqretry(&ptable.pidseq, s)) {
+            return 0;
+        }
+        p = list_entry(l, struct proc, pid_node);
+        if (p->pid == pid) {
+            return p->state == ZOMBIE ? 0 : p;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set the cpus_allowed mask of process pid. A process waiting on
+ * a cpu it may no longer use moves at once, a running one when it
+ * next leaves its cpu. Returns 0, or -1 if there is no such
+ * process or mask allows no cpu.
+ */
+int
+set_cpus_allowed(int pid, int mask)
+{
+    struct runqueue *rq;
+    struct proc *p;
+
+    mask &= ALLCPUS;
+    if (mask == 0) {
+        return -1;
+    }
+    acquire(&ptable.lock);
+    if ((p = findproc(pid)) == 0) {
+        release(&ptable.lock);
+        return -1;
+    }
+    rq = p->state == RUNNABLE ? &cpus[p->cpu].rq : 0;
+    if (rq) {
+        acquire(&rq->lock);
+    }
+    if (rq && p->state == RUNNABLE) {
+        /* Requeue, so that the queue counts the new mask. */
+        rq_unlink(rq, p);
+        p->cpus_allowed = mask;
+        if (ALLOWED(p, p->cpu)) {
+            rq_link(rq, p);
+            release(&rq->lock);
+        } else {
+            release(&rq->lock);
+            make_runnable(p);
+        }
+    } else {
+        p->cpus_allowed = mask;
+        if (rq) {
+            release(&rq->lock);
+        }
+    }
+    release(&ptable.lock);
+
+    if (p == thiscpu->proc && !ALLOWED(p, cpuid())) {
+        yield();
+    }
+    return 0;
+}
+
+/* The cpus_allowed mask of process pid, or -1 if there is none. */
+int
+get_cpus_allowed(int pid)
+{
+    struct proc *p;
+    uint32_t s;
+    int mask;
+
+    do {
+        s = readseqbegin(&ptable.pidseq);
+        p = peekproc(pid, s);
+        mask = p ? p->cpus_allowed : -1;
+    } while (readseqretry(&ptable.pidseq, s));
+    return mask;
+}
+
+/*
+ * Set the nice value of process pid, clamped to [-20, 19], and
+ * move it down at once if that lowers its highest level.
+ * Returns 0, or -1 if there is no such process.
+ */
+int
+set_nice(int pid, int nice)
+{
+    struct proc *p;
+
+    acquire(&ptable.lock);
+    if ((p = findproc(pid)) == 0) {
+        release(&ptable.lock);
+        return -1;
+    }
+    p->nice = MAX(-20, MIN(nice, 19));
+    if (p->priority > TOPPRIO(p)) {
+        set_priority(p, TOPPRIO(p));
+    }
     release(&ptable.lock);
+    return 0;
+}
+
+/* Store the nice value of process pid in *nice. Returns 0 or -1. */
+int
+get_nice(int pid, int *nice)
+{
+    struct proc *p;
+    uint32_t s;
+    int n;
+
+    do {
+        s = readseqbegin(&ptable.pidseq);
+        p = peekproc(pid, s);
+        n = p ? p->nice : 0;
+    } while (readseqretry(&ptable.pidseq, s));
+    if (p) {
+        *nice = n;
+    }
+    return p ? 0 : -1;
 }
 
 /*
@@ -416,19 +1021,34 @@ fork()
         return -1;
     } 
     
-    // uvm copy
+    // uvm copy, sharing pages copy-on-write
     p->pgdir = copyuvm(thisproc()->pgdir, thisproc()->sz);
-    if (p->pgdir == 0) {
+    if (p->pgdir == 0 || vma_copy(thisproc(), p) < 0) {
+        if (p->pgdir) {
+            vma_release(p);
+            vm_free(p->pgdir, 0);
+            p->pgdir = 0;
+        }
+        tlbi_asid(ASID(thisproc()->asid));
         kfree(p->kstack);
         p->kstack = 0;
-        p->state = UNUSED;
+        acquire(&ptable.lock);
+        proc_free(p);
+        release(&ptable.lock);
         return -1;
     } 
+    // Our writable pages just became read-only.
+    tlbi_asid(ASID(thisproc()->asid));
     
     p->sz = thisproc()->sz;
+    p->ustack = thisproc()->ustack;
+    p->heap = thisproc()->heap;
     memcpy(p->tf, thisproc()->tf, sizeof(*p->tf));
     p->tf->r0 = 0;
     p->parent = thisproc();
+    p->cpus_allowed = thisproc()->cpus_allowed;
+    p->nice = thisproc()->nice;
+    p->priority = TOPPRIO(p);
     
     
     
@@ -440,46 +1060,165 @@ fork()
     }
     
     p->cwd = idup(thisproc()->cwd);
-    p->state = RUNNABLE;
+    acquire(&ptable.lock);
+    list_add_tail(&p->sibling, &thisproc()->children);
+    make_runnable(p);
+    release(&ptable.lock);
     
     return p->pid;
 }
 
 /*
- * Wait for a child process to exit and return its pid.
- * Return -1 if this process has no children.
+ * Create a child that borrows the address space of the caller,
+ * as clone(CLONE_VM|CLONE_VFORK) does. The child runs on stack if
+ * it is non-zero, on the caller's own stack otherwise. The caller
+ * sleeps until the child calls exec or exits, so only one of them
+ * ever runs in the address space.
  */
 int
-wait()
+vfork(uint64_t stack)
+{
+    struct proc *p, *cur = thisproc();
+    int pid;
+
+    if ((p = proc_alloc()) == 0) {
+        return -1;
+    }
+    p->pgdir = cur->pgdir;
+    p->asid = cur->asid;
+    p->vfork = 1;
+    p->sz = cur->sz;
+    p->ustack = cur->ustack;
+    p->heap = cur->heap;
+    memcpy(p->tf, cur->tf, sizeof(*p->tf));
+    p->tf->r0 = 0;
+    if (stack) {
+        p->tf->sp = stack;
+    }
+    p->parent = cur;
+    p->cpus_allowed = cur->cpus_allowed;
+    p->nice = cur->nice;
+    p->priority = TOPPRIO(p);
+    for (int i = 0; i < NOFILE; i++) {
+        if (cur->ofile[i]) {
+            p->ofile[i] = filedup(cur->ofile[i]);
+        }
+    }
+    p->cwd = idup(cur->cwd);
+    pid = p->pid;
+
+    acquire(&ptable.lock);
+    list_add_tail(&p->sibling, &cur->children);
+    make_runnable(p);
+    while (p->vfork) {
+        sleep(p, &ptable.lock);
+    }
+    release(&ptable.lock);
+    return pid;
+}
+
+/*
+ * Give the address space borrowed by vfork() back to the parent
+ * and let it run again. The child must have a pgdir of its own
+ * or be exiting.
+ */
+void
+vfork_done()
+{
+    struct proc *p = thisproc();
+
+    acquire(&ptable.lock);
+    p->vfork = 0;
+    wakeup1(p, 0);
+    release(&ptable.lock);
+}
+
+/*
+ * Charge the time since the last charge to the current process,
+ * as user time if user is set, else as system time. Called on
+ * every change between user and kernel mode and around swtch().
+ */
+void
+charge(int user)
+{
+    struct proc *p = thiscpu->proc;
+    uint64_t now = timestamp();
+
+    if (user) {
+        p->ru.utime += now - p->stamp;
+    } else {
+        p->ru.stime += now - p->stamp;
+    }
+    p->stamp = now;
+}
+
+/* Add the usage in b to a. */
+static void
+usage_add(struct usage *a, struct usage *b)
+{
+    a->utime += b->utime;
+    a->stime += b->stime;
+    a->minflt += b->minflt;
+    a->majflt += b->majflt;
+    a->nvcsw += b->nvcsw;
+    a->nivcsw += b->nivcsw;
+}
+
+/*
+ * Wait for the child with the given pid, or any child if pid is
+ * -1, to exit and return its pid. Store its exit status in
+ * *status and, if ru is non-null, the usage of the child and its
+ * children in *ru. Return 0 at once if nohang is set and no such
+ * child has exited yet, -1 if there is no such child.
+ */
+int
+wait(int pid, int *status, int nohang, struct usage *ru)
 {
     /* TODO: Your code here. */
+    struct proc *p, *cur = thisproc();
+    struct list_head *l;
+
     acquire(&ptable.lock);
     while (1) {
-        int havekids = 0;
-        for (struct proc* p = ptable.proc; p < ptable.proc + NPROC; p++) {
-            if (p->parent != thisproc()) {
-                continue;
-            } 
-            havekids = 1;
-            if (p->state == ZOMBIE) {
-                int pid = p->pid;
-                
-                p->killed = 0;
-                p->state = UNUSED;
-                p->pid = 0;
-                p->parent = 0;
-                vm_free(p->pgdir, 1);
-                kfree(p->kstack);
-                
-                release(&ptable.lock);
-                return pid;
-            } 
+        p = 0;
+        for (l = cur->children.next; l != &cur->children; l = l->next) {
+            struct proc *c = list_entry(l, struct proc, sibling);
+            if ((pid == -1 || c->pid == pid) && (p == 0 || c->state == ZOMBIE)) {
+                p = c;
+                if (c->state == ZOMBIE || pid != -1) {
+                    break;
+                }
+            }
         }
-        if (havekids == 0 || thisproc()->killed) {
+        if (p && p->state == ZOMBIE) {
+            pid = p->pid;
+            *status = p->xstate;
+            usage_add(&p->ru, &p->cru);
+            usage_add(&cur->cru, &p->ru);
+            if (ru) {
+                *ru = p->ru;
+            }
+            list_del(&p->sibling);
+            p->killed = 0;
+            p->parent = 0;
+            if (p->pgdir) {
+                vm_free(p->pgdir, 0);
+            }
+            kfree(p->kstack);
+            proc_free(p);
+
+            release(&ptable.lock);
+            return pid;
+        }
+        if (p == 0 || cur->killed) {
             release(&ptable.lock);
             return -1;
-        } 
-        sleep(thisproc(), &ptable.lock);
+        }
+        if (nohang) {
+            release(&ptable.lock);
+            return 0;
+        }
+        sleep(cur, &ptable.lock);
     }
 }
 
@@ -491,7 +1230,26 @@ wait()
 void
 procdump()
 {
-    panic("unimplemented");
+    static char *states[] = {
+        [UNUSED]    "unused",
+        [EMBRYO]    "embryo",
+        [SLEEPING]  "sleep ",
+        [RUNNABLE]  "runble",
+        [RUNNING]   "run   ",
+        [ZOMBIE]    "zombie",
+    };
+    uint64_t f = timerfreq();
+    struct proc *p;
+
+    cprintf("pid  state   pri  cpu  switches  preempts  wait(ms)  name\n");
+    for (p = ptable.proc; p < &ptable.proc[ptable.nproc]; p++) {
+        if (p->state == UNUSED) {
+            continue;
+        }
+        cprintf("%d    %s  %d    %d    %d    %d    %lld    %s\n",
+                p->pid, states[p->state], p->priority, p->cpu,
+                p->nswitch, p->ru.nivcsw, p->wait * 1000 / f, p->name);
+    }
 }
 
 int
@@ -502,45 +1260,25 @@ growproc(int n)
     sz = thisproc()->sz;
 
     if(n > 0){
-        if((sz = uvm_alloc(thisproc()->pgdir, sz, sz + n)) == 0) {
+        /* Heap pages are allocated on first touch, see pgfault(). */
+        if (thisproc()->vfork || sz + n >= UADDR_SZ ||
+            vma_overlap(thisproc(), sz, ROUNDUP(sz + n, PGSIZE))) {
             return -1;
         }
-
+        sz += n;
+        thisproc()->sz = sz;
+        return 0;
     } else if(n < 0){
+        if (thisproc()->vfork || sz + n < thisproc()->heap) {
+            return -1;
+        }
         if((sz = uvm_dealloc(thisproc()->pgdir, sz, sz + n)) == 0) {
             return -1;
         }
     }
 
     thisproc()->sz = sz;
-    uvm_switch(thisproc());
+    tlbi_asid(ASID(thisproc()->asid));
 
     return 0;
 }
-
-void
-user_idle_init()
-{
-    struct proc* p;
-    /* for why our symbols differ from xv6, please refer https://stackoverflow.com/questions/10486116/what-does-this-gcc-error-relocation-truncated-to-fit-mean */
-    extern char _binary_obj_user_initcode_start[], _binary_obj_user_initcode_size[];
-
-    p = proc_alloc();
-
-    if ((p->pgdir = pgdir_init()) == 0) {
-        panic("user_idle_init: kalloc failed\n");
-    }
-
-    initproc = p;
-    uvm_init(p->pgdir, _binary_obj_user_initcode_start + 0x1c, (long)(_binary_obj_user_initcode_size - 0x1c));
-
-    // tf
-    memset(p->tf, 0, sizeof(*(p->tf)));
-    p->tf->spsr = 0;
-    p->tf->sp = PGSIZE;
-    p->tf->r30 = 0;
-    p->tf->elr = 0;
-
-    p->state = RUNNABLE;
-    p->sz = PGSIZE;
-}
@@ -0,0 +1,162 @@
+/*
+ * Slab allocator for fixed-size kernel objects.
+ *
+ * Every slab is a single page from kalloc() with a struct slab
+ * header at its start followed by nobj objects. Free objects of
+ * a slab are chained through a pointer at cache->offset, which
+ * lies past the object itself if it has a constructor, so that
+ * constructed state survives being freed. Allocation and
+ * free go through a small per-CPU stack first, and only move
+ * objects from/to the slabs in batches under cache->lock.
+ */
+
+#include <stdint.h>
+
+#include "types.h"
+#include "mmu.h"
+#include "string.h"
+#include "console.h"
+#include "kalloc.h"
+#include "slab.h"
+#include "defs.h"
+
+/* Objects moved between a per-CPU stack and the slabs at once. */
+#define SLAB_BATCH  (SLAB_CPU_CACHE / 2)
+
+struct slab {
+    struct list_head list;      /* Link in cache->partial or cache->full */
+    struct kmem_cache *cache;
+    void *free;                 /* First free object of this slab */
+    int inuse;                  /* Objects handed out */
+};
+
+#define SLAB_HDRSZ  ROUNDUP(sizeof(struct slab), 8)
+
+/* Link of a free object. */
+#define FREEPTR(c, obj) (*(void **)((char *)(obj) + (c)->offset))
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, size_t size, void (*ctor)(void *))
+{
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->size = ROUNDUP(MAX(size, sizeof(void *)), 8);
+    c->offset = ctor ? c->size : 0;
+    if (ctor)
+        c->size += sizeof(void *);
+    c->ctor = ctor;
+    c->nobj = (PGSIZE - SLAB_HDRSZ) / c->size;
+    if (c->nobj < 1)
+        panic("kmem_cache_init: %s object too large\n", name);
+    initlock(&c->lock, name);
+    INIT_LIST_HEAD(&c->partial);
+    INIT_LIST_HEAD(&c->full);
+}
+
+/*
+ * Get a fresh slab with every object constructed and free.
+ * Returns 0 if out of memory.
+ */
+static struct slab *
+slab_grow(struct kmem_cache *c)
+{
+    struct slab *s;
+    char *obj;
+
+    if ((s = (struct slab *)kalloc()) == 0)
+        return 0;
+    s->cache = c;
+    s->inuse = 0;
+    s->free = 0;
+    obj = (char *)s + SLAB_HDRSZ + (c->nobj - 1) * c->size;
+    for (int i = 0; i < c->nobj; i++, obj -= c->size) {
+        if (c->ctor)
+            c->ctor(obj);
+        FREEPTR(c, obj) = s->free;
+        s->free = obj;
+    }
+    c->nslab++;
+    return s;
+}
+
+/* Refill the per-CPU stack pc from the slabs of c. */
+static void
+slab_refill(struct kmem_cache *c, struct kmem_cache_cpu *pc)
+{
+    struct slab *s;
+    void *obj;
+
+    acquire(&c->lock);
+    while (pc->avail < SLAB_BATCH) {
+        if (list_empty(&c->partial)) {
+            if ((s = slab_grow(c)) == 0)
+                break;
+            list_add(&s->list, &c->partial);
+        }
+        s = list_first_entry(&c->partial, struct slab, list);
+        while (s->free && pc->avail < SLAB_BATCH) {
+            obj = s->free;
+            s->free = FREEPTR(c, obj);
+            s->inuse++;
+            pc->stack[pc->avail++] = obj;
+        }
+        if (s->free == 0) {
+            list_del(&s->list);
+            list_add(&s->list, &c->full);
+        }
+    }
+    release(&c->lock);
+}
+
+/* Give SLAB_BATCH objects of the per-CPU stack pc back to their slabs. */
+static void
+slab_flush(struct kmem_cache *c, struct kmem_cache_cpu *pc)
+{
+    struct slab *s;
+    void *obj;
+
+    acquire(&c->lock);
+    for (int i = 0; i < SLAB_BATCH; i++) {
+        obj = pc->stack[--pc->avail];
+        s = (struct slab *)ROUNDDOWN(obj, PGSIZE);
+        if (s->free == 0) {
+            list_del(&s->list);
+            list_add(&s->list, &c->partial);
+        }
+        FREEPTR(c, obj) = s->free;
+        s->free = obj;
+        if (--s->inuse == 0) {
+            /* Every object is back in constructed state. */
+            list_del(&s->list);
+            kfree((char *)s);
+            c->nslab--;
+        }
+    }
+    release(&c->lock);
+}
+
+/* Allocate an object from c. Returns 0 if out of memory. */
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+    struct kmem_cache_cpu *pc = &c->cpu[cpuid()];
+
+    if (pc->avail == 0)
+        slab_refill(c, pc);
+    if (pc->avail == 0)
+        return 0;
+    return pc->stack[--pc->avail];
+}
+
+/* Return an object previously allocated from c. */
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct kmem_cache_cpu *pc = &c->cpu[cpuid()];
+
+    if (((struct slab *)ROUNDDOWN(obj, PGSIZE))->cache != c)
+        panic("kmem_cache_free: object not from %s\n", c->name);
+    if (pc->avail == SLAB_CPU_CACHE)
+        slab_flush(c, pc);
+    pc->stack[pc->avail++] = obj;
+}
@@ -1,33 +1,139 @@
+#include "arm.h"
 #include "sleeplock.h"
+#include "console.h"
 #include "defs.h"
 
+/*
+ * Adaptive sleep locks.
+ *
+ * A sleep lock is mostly held for a disk-free stretch of work by a
+ * process running on another cpu, so acquiresleep() spins while
+ * the owner is RUNNING, for at most SPIN_US, before it falls back
+ * to sleep(). The owner may not be preempted in the kernel, so it
+ * either lets go soon or sleeps, and then so do we.
+ *
+ * A spinner may barge in between releasesleep() waking the longest
+ * sleeper and that sleeper running. A sleeper that finds the lock
+ * taken again asks, through lk->handoff, for the next releasesleep()
+ * to pass the lock to it directly, so it cannot starve.
+ */
+
+#define SPIN_US     50
+
+static struct {
+  uint64_t spin_win;    /* Got the lock by spinning */
+  uint64_t spin_lose;   /* Spun, then slept anyway */
+  uint64_t sleep;       /* Slept without spinning */
+  uint64_t requeue;     /* Woken, but the lock was taken again */
+} slstat[NCPU];
+
+/*
+ * Spin while owner holds lk and runs on another cpu, until lk is
+ * free or it is time to sleep instead.
+ */
+static void
+spin_on_owner(struct sleeplock *lk, struct proc *owner)
+{
+  uint64_t end = timestamp() + SPIN_US * timerfreq() / 1000000;
+
+  while (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED)) {
+    if (__atomic_load_n(&lk->owner, __ATOMIC_RELAXED) != owner ||
+        __atomic_load_n(&owner->state, __ATOMIC_RELAXED) != RUNNING ||
+        timestamp() > end) {
+      return;
+    }
+    asm volatile("yield" : : : "memory");
+  }
+}
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, name);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
+  lk->handoff = 0;
+#ifdef LOCKSTAT
+  lk->stat = lockstat_find(name, 1);
+#endif
 }
 
 void
 acquiresleep(struct sleeplock *lk)
 {
+  struct proc *owner;
+  void *chan = lk;
+  int spun = 0;
+#ifdef LOCKSTAT
+  uint64_t start = timestamp();
+  int contended;
+#endif
+
   acquire(&lk->lk);
+#ifdef LOCKSTAT
+  contended = lk->locked;
+#endif
   while (lk->locked) {
-    sleep(lk, &lk->lk);
+    owner = lk->owner;
+    if (!spun && owner && owner != thisproc() && owner->state == RUNNING) {
+      spun = 1;
+      release(&lk->lk);
+      spin_on_owner(lk, owner);
+      acquire(&lk->lk);
+      continue;
+    }
+    if (spun == 1) {
+      slstat[cpuid()].spin_lose++;
+    } else if (spun == 0) {
+      slstat[cpuid()].sleep++;
+    } else {
+      slstat[cpuid()].requeue++;
+      if (lk->handoff == 0) {
+        lk->handoff = thisproc();
+        chan = &lk->handoff;
+      }
+    }
+    spun = 2;
+    sleep(chan, &lk->lk);
+    if (chan != lk) {
+      /* releasesleep() made us the owner. */
+      break;
+    }
+  }
+  if (spun == 1) {
+    slstat[cpuid()].spin_win++;
   }
   lk->locked = 1;
   lk->pid = thisproc()->pid;
+  lk->owner = thisproc();
+#ifdef LOCKSTAT
+  lk->stamp = timestamp();
+  lockstat_acquired(lk->stat, contended, lk->stamp - start);
+#endif
   release(&lk->lk);
 }
 
 void
 releasesleep(struct sleeplock *lk)
 {
+  struct proc *p;
+
   acquire(&lk->lk);
-  lk->locked = 0;
-  lk->pid = 0;
-  wakeup(lk);
+#ifdef LOCKSTAT
+  lockstat_released(lk->stat, timestamp() - lk->stamp);
+#endif
+  if ((p = lk->handoff)) {
+    lk->handoff = 0;
+    lk->pid = p->pid;
+    lk->owner = p;
+    wakeup(&lk->handoff);
+  } else {
+    lk->locked = 0;
+    lk->pid = 0;
+    lk->owner = 0;
+    wakeup_one(lk);
+  }
   release(&lk->lk);
 }
 
@@ -41,3 +147,19 @@ holdingsleep(struct sleeplock *lk)
   release(&lk->lk);
   return r;
 }
+
+/*
+ * Print how often acquiresleep() got a held lock by spinning.
+ * Runs when user types ^L on console.
+ * No lock since the counters are only advisory.
+ */
+void
+sleeplock_stat()
+{
+  cprintf("sleeplock: cpu  spin won  spin lost  slept  requeued\n");
+  for (int i = 0; i < NCPU; i++) {
+    cprintf("sleeplock: %d    %lld  %lld  %lld  %lld\n",
+            i, slstat[i].spin_win, slstat[i].spin_lose, slstat[i].sleep,
+            slstat[i].requeue);
+  }
+}
@@ -5,6 +5,99 @@
 #include "string.h"
 #include "defs.h"
 
+#ifdef LOCKSTAT
+
+#define NLOCKSTAT   64
+
+static struct lockstat lockstats[NLOCKSTAT];
+
+/*
+ * Find the statistics of the locks of this kind named name, making
+ * a new entry if there is none. An entry is claimed first and its
+ * name published only once it is filled in, so no lock is needed
+ * to look one up or add one.
+ */
+struct lockstat *
+lockstat_find(char *name, int sleep)
+{
+    struct lockstat *s;
+    char *n;
+    int free;
+
+    if (name == 0) {
+        return 0;
+    }
+    for (s = lockstats; s < &lockstats[NLOCKSTAT]; s++) {
+        free = 0;
+        if (__atomic_compare_exchange_n(&s->claimed, &free, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            s->sleep = sleep;
+            __atomic_store_n(&s->name, name, __ATOMIC_RELEASE);
+            return s;
+        }
+        /* Claimed by someone else, wait until it is filled in. */
+        while ((n = __atomic_load_n(&s->name, __ATOMIC_ACQUIRE)) == 0)
+            ;
+        if (strcmp(n, name) == 0 && s->sleep == sleep) {
+            return s;
+        }
+    }
+    return 0;
+}
+
+void
+lockstat_acquired(struct lockstat *s, int contended, uint64_t wait)
+{
+    if (s == 0) {
+        return;
+    }
+    __atomic_add_fetch(&s->acquired, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_add_fetch(&s->contended, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s->wait, wait, __ATOMIC_RELAXED);
+    }
+}
+
+void
+lockstat_released(struct lockstat *s, uint64_t hold)
+{
+    uint64_t max;
+
+    if (s == 0) {
+        return;
+    }
+    max = __atomic_load_n(&s->maxhold, __ATOMIC_RELAXED);
+    while (hold > max && !__atomic_compare_exchange_n(&s->maxhold, &max, hold, 0,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Print the statistics of every lock name that has been taken.
+ * Runs when user types ^L on console.
+ * No lock since the counters are only advisory.
+ */
+void
+lockstat_dump()
+{
+    struct lockstat *s;
+    uint64_t f = timerfreq();
+
+    cprintf("lockstat: name  kind  acquired  contended  wait(us)  avg wait(ns)  max hold(us)\n");
+    for (s = lockstats; s < &lockstats[NLOCKSTAT] && s->name; s++) {
+        if (s->acquired == 0) {
+            continue;
+        }
+        cprintf("lockstat: %s  %s  %lld  %lld (%lld%%)  %lld  %lld  %lld\n",
+                s->name, s->sleep ? "sleep" : "spin", s->acquired, s->contended,
+                s->contended * 100 / s->acquired, s->wait * 1000000 / f,
+                s->contended ? s->wait * 1000 / s->contended * 1000000 / f : 0,
+                s->maxhold * 1000000 / f);
+    }
+}
+
+#endif
+
 /*
  * Check whether this cpu is holding the lock.
  */
@@ -12,26 +105,65 @@ int
 holding(struct spinlock *lk)
 {
     int hold;
-    hold = lk->locked && lk->cpu == thiscpu;
+    hold = lk->owner != lk->next && lk->cpu == thiscpu;
     return hold;
 }
 
 void
 initlock(struct spinlock *lk, char *name) {
     lk->name = name;
-    lk->locked = 0;
+    lk->owner = lk->next = 0;
     lk->cpu = 0;
+#ifdef LOCKSTAT
+    lk->stat = lockstat_find(name, 0);
+#endif
+}
+
+/*
+ * Wait in wfe until lk->owner reaches ticket t. The load-exclusive
+ * arms the monitor on owner, so the store of release() sends the
+ * event that wakes us; sevl makes the first wfe fall through.
+ */
+static inline void
+ticket_wait(struct spinlock *lk, uint16_t t)
+{
+    uint32_t cur;
+
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "   ldaxrh  %w0, [%1]\n"
+        "   cmp     %w0, %w2, uxth\n"
+        "   b.ne    1b\n"
+        : "=&r"(cur)
+        : "r"(&lk->owner), "r"(t)
+        : "cc", "memory");
 }
 
 void
 acquire(struct spinlock *lk)
 {
+    uint16_t t;
+#ifdef LOCKSTAT
+    uint64_t start = timestamp();
+    int contended = 0;
+#endif
+
     if (holding(lk)) {
         panic("acquire: spinlock already held\n");
     }
-    while (lk->locked || __atomic_test_and_set(&lk->locked, __ATOMIC_ACQUIRE))
-        ;
+    t = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != t) {
+        ticket_wait(lk, t);
+#ifdef LOCKSTAT
+        contended = 1;
+#endif
+    }
     lk->cpu = thiscpu;
+#ifdef LOCKSTAT
+    lk->stamp = timestamp();
+    lockstat_acquired(lk->stat, contended, lk->stamp - start);
+#endif
 }
 
 void
@@ -40,6 +172,168 @@ release(struct spinlock *lk)
     if (!holding(lk)) {
         panic("release: not locked\n");
     }
+#ifdef LOCKSTAT
+    lockstat_released(lk->stat, timestamp() - lk->stamp);
+#endif
     lk->cpu = NULL;
-    __atomic_clear(&lk->locked, __ATOMIC_RELEASE);
-}
\ No newline at end of file
+    /* Clears the monitors of the waiters, which wakes them. */
+    __atomic_store_n(&lk->owner, (uint16_t)(lk->owner + 1), __ATOMIC_RELEASE);
+}
+
+/* Wait in wfe until none of the bits in mask are set in *word. */
+static inline void
+wait_clear(volatile uint32_t *word, uint32_t mask)
+{
+    uint32_t cur;
+
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "   ldaxr   %w0, [%1]\n"
+        "   tst     %w0, %w2\n"
+        "   b.ne    1b\n"
+        : "=&r"(cur)
+        : "r"(word), "r"(mask)
+        : "cc", "memory");
+}
+
+void
+initrwlock(struct rwspinlock *lk, char *name)
+{
+    lk->name = name;
+    lk->cnt = 0;
+#ifdef LOCKSTAT
+    lk->stat = lockstat_find(name, 0);
+#endif
+}
+
+void
+acquireread(struct rwspinlock *lk)
+{
+    uint32_t v;
+#ifdef LOCKSTAT
+    uint64_t start = timestamp();
+    int contended = 0;
+#endif
+
+    for (;;) {
+        v = __atomic_load_n(&lk->cnt, __ATOMIC_RELAXED);
+        if (!(v & RW_WRITER) &&
+            __atomic_compare_exchange_n(&lk->cnt, &v, v + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (v & RW_WRITER) {
+            wait_clear(&lk->cnt, RW_WRITER);
+#ifdef LOCKSTAT
+            contended = 1;
+#endif
+        }
+    }
+#ifdef LOCKSTAT
+    lockstat_acquired(lk->stat, contended, timestamp() - start);
+#endif
+}
+
+void
+releaseread(struct rwspinlock *lk)
+{
+    if ((lk->cnt & ~RW_WRITER) == 0) {
+        panic("releaseread: not locked\n");
+    }
+    __atomic_sub_fetch(&lk->cnt, 1, __ATOMIC_RELEASE);
+}
+
+void
+acquirewrite(struct rwspinlock *lk)
+{
+    uint32_t v;
+#ifdef LOCKSTAT
+    uint64_t start = timestamp();
+    int contended = 0;
+#endif
+
+    /* Claim the lock against other writers, then let readers drain. */
+    for (;;) {
+        v = __atomic_load_n(&lk->cnt, __ATOMIC_RELAXED);
+        if (!(v & RW_WRITER) &&
+            __atomic_compare_exchange_n(&lk->cnt, &v, v | RW_WRITER, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (v & RW_WRITER) {
+            wait_clear(&lk->cnt, RW_WRITER);
+#ifdef LOCKSTAT
+            contended = 1;
+#endif
+        }
+    }
+    if (v != 0) {
+        wait_clear(&lk->cnt, ~RW_WRITER);
+#ifdef LOCKSTAT
+        contended = 1;
+#endif
+    }
+#ifdef LOCKSTAT
+    lk->stamp = timestamp();
+    lockstat_acquired(lk->stat, contended, lk->stamp - start);
+#endif
+}
+
+/*
+ * Only writers have their hold time recorded; readers overlap,
+ * and one stamp per reader would need somewhere to live.
+ */
+void
+releasewrite(struct rwspinlock *lk)
+{
+    if (lk->cnt != RW_WRITER) {
+        panic("releasewrite: not locked\n");
+    }
+#ifdef LOCKSTAT
+    lockstat_released(lk->stat, timestamp() - lk->stamp);
+#endif
+    __atomic_store_n(&lk->cnt, 0, __ATOMIC_RELEASE);
+}
+
+void
+initseqlock(struct seqlock *sl, char *name)
+{
+    sl->seq = 0;
+    initlock(&sl->lock, name);
+}
+
+/* Start an update: readers from now on retry until releaseseq(). */
+void
+acquireseq(struct seqlock *sl)
+{
+    acquire(&sl->lock);
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+releaseseq(struct seqlock *sl)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+    release(&sl->lock);
+}
+
+/* Start a read, waiting out any update in progress. */
+uint32_t
+readseqbegin(struct seqlock *sl)
+{
+    uint32_t s;
+
+    while ((s = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return s;
+}
+
+/* Did an update overlap the read started with s? */
+int
+readseqretry(struct seqlock *sl, uint32_t s)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != s;
+}
@@ -0,0 +1,62 @@
+#include "arm.h"
+#include "spinlock.h"
+#include "console.h"
+#include "proc.h"
+#include "defs.h"
+
+/*
+ * Spinlock contention test: every cpu takes and drops one lock
+ * for LOCK_TEST_MS, counting its acquisitions. With a fair lock
+ * the counts come out close to each other.
+ */
+
+#define LOCK_TEST_MS    200
+
+static struct spinlock lock;
+static volatile int arrived, left;
+static uint64_t count[NCPU];
+static volatile uint64_t shared;
+
+static void
+barrier(volatile int *n)
+{
+    __atomic_add_fetch(n, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(n, __ATOMIC_ACQUIRE) < NCPU)
+        ;
+}
+
+void
+test_spinlock()
+{
+    int me = cpuid();
+    uint64_t n = 0, start, end;
+    uint64_t total = 0, lo = ~0UL, hi = 0;
+
+    barrier(&arrived);
+    start = timestamp();
+    end = start + timerfreq() / 1000 * LOCK_TEST_MS;
+    while (timestamp() < end) {
+        acquire(&lock);
+        shared++;
+        release(&lock);
+        n++;
+    }
+    count[me] = n;
+    barrier(&left);
+
+    if (me != 0) {
+        return;
+    }
+    for (int i = 0; i < NCPU; i++) {
+        cprintf("test_spinlock: [CPU%d] %lld acquisitions\n", i, count[i]);
+        total += count[i];
+        lo = MIN(lo, count[i]);
+        hi = MAX(hi, count[i]);
+    }
+    if (total != shared) {
+        panic("test_spinlock: %lld acquisitions, counter %lld\n", total, shared);
+    }
+    cprintf("test_spinlock: %lld acquisitions in %d ms, %lld ns each, min/max %lld%%\n",
+            total, LOCK_TEST_MS, LOCK_TEST_MS * 1000000UL / MAX(total, 1),
+            lo * 100 / MAX(hi, 1));
+}
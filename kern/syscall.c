@@ -1,8 +1,15 @@
 #include <syscall.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "arm.h"
+#include "mmu.h"
 #include "string.h"
 #include "proc.h"
 #include "console.h"
 #include "sd.h"
+#include "mmap.h"
+#include "file.h"
 #include "defs.h"
 
 /* 
@@ -11,14 +18,61 @@
  * library system call function.
  */
 
+/*
+ * Check that the current process may read [addr, addr+len), or
+ * write it if write is set, so that the kernel can then touch it
+ * directly. Below p->sz the heap and stack are read-write, but the
+ * pages below the stack must be there, which leaves out the guard
+ * page. Above it, the range must lie in one mapping that allows
+ * the access, see vma_access().
+ *
+ * Demand-zero and copy-on-write pages are faulted in here, so that
+ * running out of memory fails the system call instead of a kernel
+ * data abort, which has no way to back out of it.
+ * Returns 0 or -EFAULT.
+ */
+int
+uaccess(uint64_t addr, uint64_t len, int write)
+{
+    struct proc *p = thiscpu->proc;
+    uint64_t va, *pte;
+    int r;
+
+    if (addr + len < addr) {
+        return -EFAULT;
+    }
+    if (addr + len <= p->sz) {
+        for (va = ROUNDDOWN(addr, PGSIZE); va < addr + len; va += PGSIZE) {
+            pte = pgdir_walk(p->pgdir, (void *)va, 0);
+            if (pte == 0 || (*pte & PTE_P) == 0) {
+                if (va < p->ustack) {
+                    return -EFAULT;
+                }
+                r = uvm_demand(p->pgdir, va);
+            } else if (write && (*pte & PTE_COW)) {
+                r = uvm_cow(p->pgdir, va);
+            } else {
+                continue;
+            }
+            if (r < 0) {
+                return -EFAULT;
+            }
+            p->ru.minflt++;
+        }
+        return 0;
+    }
+    if (addr >= p->sz && vma_access(p, addr, len, write) == 0) {
+        return 0;
+    }
+    return -EFAULT;
+}
+
 /* Fetch the int at addr from the current process. */
 int
 fetchint(uint64_t addr, int64_t *ip)
 {
-    struct proc *proc = thiscpu->proc;
-
-    if (addr >= proc->sz || addr + 8 > proc->sz) {
-        return -1;
+    if (uaccess(addr, 8, 0) < 0) {
+        return -EFAULT;
     }
     *ip = *(int64_t*)(addr);
     return 0;
@@ -32,34 +86,30 @@ fetchint(uint64_t addr, int64_t *ip)
 int
 fetchstr(uint64_t addr, char **pp)
 {
-    char *s, *ep;
-    struct proc *proc = thiscpu->proc;
-
-    if (addr >= proc->sz) {
-        return -1;
-    }
+    char *s;
 
     *pp = (char*)addr;
-    ep = (char*)proc->sz;
 
-    for (s = *pp; s < ep; s++) {
+    /* Check each page before the string runs into it. */
+    for (s = *pp; ; s++) {
+        if ((s == *pp || (uint64_t)s % PGSIZE == 0) && uaccess((uint64_t)s, 1, 0) < 0) {
+            return -EFAULT;
+        }
         if (*s == 0) {
             return s - *pp;
         }
     }
-
-    return -1;
 }
 
 /* 
  * Fetch the nth (starting from 0) 32-bit system call argument.
- * In our ABI, r0 contains system call index, r1-r4 contain parameters.
- * now we support system calls with at most 4 parameters.
+ * In our ABI, r8 contains system call index, r0-r5 contain parameters.
+ * now we support system calls with at most 6 parameters.
  */
 int
 argint(int n, uint64_t *ip)
 {
-    if (n > 3) {
+    if (n > 5) {
         panic("argint: too many system call parameters\n");
     }
 
@@ -72,22 +122,19 @@ argint(int n, uint64_t *ip)
 
 /* 
  * Fetch the nth word-sized system call argument as a pointer
- * to a block of memory of size n bytes.  Check that the pointer
- * lies within the process address space.
+ * to a block of memory of size n bytes.  Check that the process
+ * may read the block, or write it if write is set.
  */
 int
-argptr(int n, char **pp, int size)
+argptr(int n, char **pp, uint64_t size, int write)
 {
     uint64_t i;
 
     if (argint(n, &i) < 0) {
         return -1;
     }
-
-    struct proc *proc = thiscpu->proc;
-
-    if ((uint64_t)i >= proc->sz || (uint64_t)i + size > proc->sz) {
-        return -1;
+    if (uaccess(i, size, write) < 0) {
+        return -EFAULT;
     }
 
     *pp = (char*)i;
@@ -112,106 +159,198 @@ argstr(int n, char **pp)
     return fetchstr(addr, pp);
 }
 
-extern int sys_exec();
-extern int sys_exit();
+extern int64_t sys_exec();
+extern int64_t sys_exit();
+extern int64_t sys_yield();
+extern int64_t sys_brk();
+extern int64_t sys_clone();
+extern int64_t sys_wait4();
+extern int64_t sys_mmap();
+extern int64_t sys_munmap();
+extern int64_t sys_madvise();
+extern int64_t sys_nanosleep();
+extern int64_t sys_clock_nanosleep();
+extern int64_t sys_clock_gettime();
+extern int64_t sys_sched_setaffinity();
+extern int64_t sys_sched_getaffinity();
+extern int64_t sys_setpriority();
+extern int64_t sys_getpriority();
+extern int64_t sys_getrusage();
+extern int64_t sys_times();
+extern int64_t sys_dup();
+extern int64_t sys_chdir();
+extern int64_t sys_fstat();
+extern int64_t sys_fstatat();
+extern int64_t sys_mkdirat();
+extern int64_t sys_mknodat();
+extern int64_t sys_openat();
+extern int64_t sys_writev();
+extern int64_t sys_read();
+extern int64_t sys_write();
+extern int64_t sys_close();
 
-int
+/* Every process has exactly one thread, whose tid is the pid. */
+static int64_t
+sys_gettid()
+{
+    return thisproc()->pid;
+}
+
+/*
+ * Only TIOCGWINSZ, which musl's isatty() uses, is answered, with a
+ * window size of zero. Everything else is not a terminal request.
+ */
+static int64_t
+sys_ioctl()
+{
+    char *ws;
+
+    if (thisproc()->tf->r1 != TIOCGWINSZ)
+        return -ENOTTY;
+    if (argptr(2, &ws, sizeof(struct winsize), 1) < 0)
+        return -EFAULT;
+    memset(ws, 0, sizeof(struct winsize));
+    return 0;
+}
+
+/* There are no signals, so there is no mask to change. */
+static int64_t
+sys_rt_sigprocmask()
+{
+    return 0;
+}
+
+static int64_t (*syscalls[])() = {
+    [SYS_set_tid_address]   sys_gettid,
+    [SYS_gettid]            sys_gettid,
+    [SYS_ioctl]             sys_ioctl,
+    [SYS_rt_sigprocmask]    sys_rt_sigprocmask,
+    [SYS_brk]               sys_brk,
+    [SYS_mmap]              sys_mmap,
+    [SYS_munmap]            sys_munmap,
+    [SYS_madvise]           sys_madvise,
+    [SYS_execve]            sys_exec,
+    [SYS_sched_yield]       sys_yield,
+    [SYS_sched_setaffinity] sys_sched_setaffinity,
+    [SYS_sched_getaffinity] sys_sched_getaffinity,
+    [SYS_setpriority]       sys_setpriority,
+    [SYS_getpriority]       sys_getpriority,
+    [SYS_getrusage]         sys_getrusage,
+    [SYS_times]             sys_times,
+    [SYS_clone]             sys_clone,
+    [SYS_nanosleep]         sys_nanosleep,
+    [SYS_clock_nanosleep]   sys_clock_nanosleep,
+    [SYS_clock_gettime]     sys_clock_gettime,
+    [SYS_wait4]             sys_wait4,
+    // FIXME: exit_group should kill every thread in the current thread group.
+    [SYS_exit_group]        sys_exit,
+    [SYS_exit]              sys_exit,
+    [SYS_dup]               sys_dup,
+    [SYS_chdir]             sys_chdir,
+    [SYS_fstat]             sys_fstat,
+    [SYS_newfstatat]        sys_fstatat,
+    [SYS_mkdirat]           sys_mkdirat,
+    [SYS_mknodat]           sys_mknodat,
+    [SYS_openat]            sys_openat,
+    [SYS_writev]            sys_writev,
+    [SYS_read]              sys_read,
+    [SYS_write]             sys_write,
+    [SYS_close]             sys_close,
+};
+
+#define NSYSCALL    ARRAY_SIZE(syscalls)
+
+#ifdef SYSCALL_STATS
+
+/*
+ * Per-cpu call counts and latency histograms of each system call,
+ * in system counter ticks. hist[i] counts the calls that took
+ * [2^i, 2^(i+1)) ticks, the first and last also those below and
+ * above. Time spent asleep in a call counts too.
+ *
+ * Reading the sysstat device (major SYSSTAT) returns the sums over
+ * all cpus as an array of struct sysstat indexed by number.
+ */
+
+#define SYSSTAT     2
+#define NHIST       24
+
+struct sysstat {
+    uint64_t count;
+    uint64_t ticks;
+    uint32_t hist[NHIST];
+};
+
+static struct sysstat sysstats[NCPU][NSYSCALL];
+
+static void
+sysstat_add(int sysno, uint64_t ticks)
+{
+    struct sysstat *st = &sysstats[cpuid()][sysno];
+    int b = ticks ? 63 - __builtin_clzl(ticks) : 0;
+
+    st->count++;
+    st->ticks += ticks;
+    st->hist[MIN(b, NHIST - 1)]++;
+}
+
+static ssize_t
+sysstat_read(struct inode *ip, char *dst, ssize_t n)
+{
+    struct sysstat sum;
+    ssize_t i;
+
+    n = MIN(n / (ssize_t)sizeof(sum), (ssize_t)NSYSCALL);
+    for (i = 0; i < n; i++) {
+        memset(&sum, 0, sizeof(sum));
+        for (int c = 0; c < NCPU; c++) {
+            sum.count += sysstats[c][i].count;
+            sum.ticks += sysstats[c][i].ticks;
+            for (int b = 0; b < NHIST; b++) {
+                sum.hist[b] += sysstats[c][i].hist[b];
+            }
+        }
+        memmove(dst + i * sizeof(sum), &sum, sizeof(sum));
+    }
+    return n * sizeof(sum);
+}
+
+void
+sysstat_init()
+{
+    devsw[SYSSTAT].read = sysstat_read;
+}
+
+#endif
+
+/* Unknown system calls are only reported this many times. */
+#define NSYSWARN 8
+static int nsyswarn;
+
+/*
+ * Dispatch the system call numbered tf->r8 through syscalls[],
+ * returning its result in r0. Unknown numbers get -ENOSYS.
+ */
+int64_t
 syscall1(struct trapframe *tf)
 {
+    uint64_t sysno = tf->r8;
+    int64_t ret;
+#ifdef SYSCALL_STATS
+    uint64_t start = timestamp();
+#endif
+
     thisproc()->tf = tf;
-    int sysno = tf->r8;
-    int tret;
-    // cprintf("syscall1: sysno=%d, r0=%s\n", sysno, tf->r0);
-    switch (sysno) {
-        // FIXME: Use pid instead of tid since we don't have threads :)
-        case SYS_set_tid_address:
-        case SYS_gettid:            // 96
-            // cprintf("%d=%d\n", sysno, thisproc()->pid);
-            return tf->r0 = thisproc()->pid;
-
-        // FIXME: Hack TIOCGWINSZ(get window size)
-        case SYS_ioctl:
-            // cprintf("%d=%d\n", sysno, 0);
-            if (tf->r1 == 0x5413) return 0;
-            else panic("ioctl unimplemented. ");
-        
-        // FIXME: Always return 0 since we don't have signals  :)
-        case SYS_rt_sigprocmask:
-            return tf->r0 = 0;
-        case SYS_brk:
-            tret = sys_brk();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_execve:            // 221
-            tret = sys_exec();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_sched_yield:
-            tret = sys_yield();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_clone:             // 220
-            tret = sys_clone();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_wait4:
-            tret = sys_wait4();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-            
-        // FIXME: exit_group should kill every thread in the current thread group.
-        case SYS_exit_group:
-        case SYS_exit:
-            tret = sys_exit();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_dup:               // 23
-            tret = sys_dup();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_chdir:
-            tret = sys_chdir();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_fstat:
-            tret = sys_fstat();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_newfstatat:
-            tret = sys_fstatat();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_mkdirat:
-            tret = sys_mkdirat();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_mknodat:           // 33
-            tret = sys_mknodat();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_openat:            // 56
-            tret = sys_openat();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_writev:            // 66
-            tret = sys_writev();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_read:
-            tret = sys_read();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        case SYS_write:
-            return tf->r0 = sys_write();
-        case SYS_close:
-            tret = sys_close();
-            // cprintf("%d=%d\n", sysno, tret);
-            return tf->r0 = tret;
-        
-        default:
-            // FIXME: don't panic.
-            // debug_reg();
-            panic("Unexpected syscall #%d\n", sysno);
-            return 0;
+    if (sysno >= NSYSCALL || syscalls[sysno] == 0) {
+        if (__atomic_fetch_add(&nsyswarn, 1, __ATOMIC_RELAXED) < NSYSWARN)
+            cprintf("syscall1: pid %d: unknown syscall %lld\n", thisproc()->pid, sysno);
+        ret = -ENOSYS;
+    } else {
+        ret = syscalls[sysno]();
+#ifdef SYSCALL_STATS
+        sysstat_add(sysno, timestamp() - start);
+#endif
     }
+    tf->r0 = ret;
+    return ret;
 }
@@ -4,7 +4,9 @@
 // user code, and calls into file.c and fs.c.
 //
 
+#include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 #include "types.h"
 #include "mmu.h"
@@ -22,6 +24,11 @@ struct iovec {
     size_t iov_len;     /* Number of bytes to transfer. */
 };
 
+/* As in Linux <limits.h>. */
+#define IOV_MAX     1024
+/* iovecs copied onto the kernel stack at once by writev(). */
+#define NIOV        16
+
 /*
  * Fetch the nth word-sized system call argument as a file descriptor
  * and return both the descriptor and the corresponding struct file.
@@ -64,7 +71,7 @@ fdalloc(struct file *f)
     return -1;
 }
 
-int
+int64_t
 sys_dup()
 {
     /* TODO: Your code here. */
@@ -81,7 +88,7 @@ sys_dup()
     return fd;
 }
 
-ssize_t
+int64_t
 sys_read()
 {
     /* TODO: Your code here. */
@@ -90,14 +97,16 @@ sys_read()
     ssize_t n;
 
     if (argfd(0, 0, &f) < 0 ||
-        argint(2, &n) < 0 ||
-        argptr(1, &addr, n) < 0) {
+        argint(2, &n) < 0) {
         return -1;
     } 
+    if (argptr(1, &addr, n, 1) < 0) {
+        return -EFAULT;
+    }
     return fileread(f, addr, n);
 }
 
-ssize_t
+int64_t
 sys_write()
 {
     /* TODO: Your code here. */
@@ -106,15 +115,17 @@ sys_write()
     ssize_t n;
 
     if (argfd(0, 0, &f) < 0 ||
-        argint(2, &n) < 0 ||
-        argptr(1, &addr, n) < 0) {
+        argint(2, &n) < 0) {
         return -1;
     } 
+    if (argptr(1, &addr, n, 0) < 0) {
+        return -EFAULT;
+    }
     return filewrite(f, addr, n);
 }
 
 
-ssize_t
+int64_t
 sys_writev()
 {
     /* TODO: Your code here. */
@@ -127,7 +138,7 @@ sys_writev()
      * struct iovec *iov, *p;
      * if (argfd(0, &fd, &f) < 0 ||
      *     argint(2, &iovcnt) < 0 ||
-     *     argptr(1, &iov, iovcnt * sizeof(struct iovec)) < 0) {
+     *     argptr(1, &iov, iovcnt * sizeof(struct iovec), 0) < 0) {
      *     return -1;
      * }
      *
@@ -142,29 +153,42 @@ sys_writev()
      * ```
      */
 
+    /*
+     * The iovecs are copied in before use, NIOV at a time, so that
+     * an entry cannot change between its check and the write, say
+     * by a child sharing the array through a MAP_SHARED mapping.
+     */
     struct file *f;
     int64_t fd, iovcnt;
-    struct iovec *iov;
-    int ret1, ret2, ret3;
+    struct iovec *iov, kiov[NIOV];
+    int ret1, ret2, n;
 
     ret1 = argfd(0, &fd, &f);
     ret2 = argint(2, &iovcnt);
-    ret3 = argptr(1, &iov, iovcnt * sizeof(struct iovec));
-    if (ret1 < 0 || ret2 < 0 || ret3 < 0) {
-        // cprintf("sys_writev: %d %d %d\n", ret1, ret2, ret3);
+    if (ret1 < 0 || ret2 < 0) {
         return -1;
     }
+    if (iovcnt < 0 || iovcnt > IOV_MAX) {
+        return -EINVAL;
+    }
+    if (argptr(1, (char **)&iov, iovcnt * sizeof(struct iovec), 0) < 0) {
+        return -EFAULT;
+    }
     size_t tot = 0;
-    for (struct iovec* p = iov; p < iov + iovcnt; p++) {
-        if (0) {
-            return -1;
-        } 
-        tot += filewrite(f, p->iov_base, p->iov_len);
+    for (; iovcnt > 0; iov += n, iovcnt -= n) {
+        n = MIN(iovcnt, NIOV);
+        memmove(kiov, iov, n * sizeof(struct iovec));
+        for (struct iovec *p = kiov; p < kiov + n; p++) {
+            if (uaccess((uint64_t)p->iov_base, p->iov_len, 0) < 0) {
+                return -EFAULT;
+            }
+            tot += filewrite(f, p->iov_base, p->iov_len);
+        }
     }
     return tot;
 }
 
-int
+int64_t
 sys_close()
 {
     /* TODO: Your code here. */
@@ -181,22 +205,24 @@ sys_close()
     return 0;
 }
 
-int
+int64_t
 sys_fstat()
 {
     /* TODO: Your code here. */
     struct file *f;
     struct stat *st;
 
-    if (argfd(0, 0, &f) < 0 ||
-        argptr(1, (void*)&st, sizeof(*st)) < 0) {
+    if (argfd(0, 0, &f) < 0) {
         return -1;
     }
+    if (argptr(1, (void*)&st, sizeof(*st), 1) < 0) {
+        return -EFAULT;
+    }
 
     return filestat(f, st);
 }
 
-int
+int64_t
 sys_fstatat()
 {
     int64_t dirfd, flags;
@@ -205,9 +231,9 @@ sys_fstatat()
 
     if (argint(0, &dirfd) < 0 ||
         argstr(1, &path) < 0 ||
-        argptr(2, (void *)&st, sizeof(*st)) < 0 ||
+        argptr(2, (void *)&st, sizeof(*st), 1) < 0 ||
         argint(3, &flags) < 0)
-        return -1;
+        return -EFAULT;
 
     if (dirfd != AT_FDCWD) {
         cprintf("sys_fstatat: dirfd unimplemented\n");
@@ -282,7 +308,7 @@ create(char *path, short type, short major, short minor)
     return ip;
 }
 
-int
+int64_t
 sys_openat()
 {
     char *path;
@@ -341,7 +367,7 @@ sys_openat()
     return fd;
 }
 
-int
+int64_t
 sys_mkdirat()
 {
     int64_t dirfd, mode;
@@ -369,7 +395,7 @@ sys_mkdirat()
     return 0;
 }
 
-int
+int64_t
 sys_mknodat()
 {
     struct inode *ip;
@@ -395,7 +421,7 @@ sys_mknodat()
     return 0;
 }
 
-int
+int64_t
 sys_chdir()
 {
     char *path;
@@ -420,7 +446,7 @@ sys_chdir()
     return 0;
 }
 
-int
+int64_t
 sys_exec()
 {
     /* TODO: Your code here. */
@@ -453,3 +479,59 @@ sys_exec()
     return execve(path, argv, (char **)0);
 }
 
+
+int64_t
+sys_mmap()
+{
+    uint64_t addr, len, prot, flags, off;
+    struct file *f = 0;
+
+    if (argint(0, &addr) < 0 ||
+        argint(1, &len) < 0 ||
+        argint(2, &prot) < 0 ||
+        argint(3, &flags) < 0 ||
+        argint(5, &off) < 0) {
+        return -1;
+    }
+    if (!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0) {
+        return -1;
+    }
+    return vma_map(addr, len, prot, flags, f, off);
+}
+
+int64_t
+sys_munmap()
+{
+    uint64_t addr, len;
+
+    if (argint(0, &addr) < 0 || argint(1, &len) < 0) {
+        return -1;
+    }
+    return vma_unmap(addr, len);
+}
+
+/*
+ * MADV_FREE may drop pages at once, just like MADV_DONTNEED.
+ * Every other advice is a hint, which is taken as read.
+ */
+int64_t
+sys_madvise()
+{
+    uint64_t addr, len, advice;
+
+    if (argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &advice) < 0) {
+        return -1;
+    }
+    switch (advice) {
+    case MADV_DONTNEED:
+    case MADV_FREE:
+        return vma_dontneed(addr, len) < 0 ? -EINVAL : 0;
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+    case MADV_WILLNEED:
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
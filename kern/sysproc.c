@@ -1,70 +1,318 @@
 #include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/times.h>
 
 #include "proc.h"
+#include "string.h"
 #include "trap.h"
 #include "console.h"
 #include "defs.h"
 
-int
+/* clone() flags, as in Linux <sched.h>. */
+#define CLONE_VM        0x00000100
+#define CLONE_VFORK     0x00004000
+#define SIGCHLD         17
+
+/* wait4() options, as in <sys/wait.h>, which clashes with wait(). */
+#define WNOHANG         1
+#define WUNTRACED       2
+
+int64_t
 sys_exit()
 {
+    uint64_t code;
+
+    if (argint(0, &code) < 0)
+        return -1;
+    thisproc()->xstate = (code & 0xff) << 8;
     exit();
     return 0;
 }
 
-int
+int64_t
 sys_yield()
 {
+    thisproc()->ru.nvcsw++;
     yield();
     return 0;
 }
 
-size_t
+int64_t
 sys_brk()
 {
     /* TODO: Your code here. */
-    uint64_t n;
-    if(argint(0, &n) < 0) {
+    uint64_t addr;
+    if(argint(0, &addr) < 0) {
         return -1;
     }
+    /* Like Linux, return the current break if it cannot be moved. */
     size_t sz = thisproc()->sz;
-    if(growproc(n) < 0) {
-        return -1;
+    if(addr == 0 || addr < thisproc()->heap || growproc(addr - sz) < 0) {
+        return sz;
     }
-    return sz;
+    return thisproc()->sz;
 }
 
-int
+int64_t
 sys_clone()
 {
     void *childstk;
     uint64_t flag;
     if (argint(0, &flag) < 0 || argint(1, &childstk) < 0)
         return -1;
-    if (flag != 17) {
-        cprintf("sys_clone: flags other than SIGCHLD are not supported.\n");
-        return -1;
+    if (flag == SIGCHLD) {
+        return fork();
+    }
+    /* vfork(), posix_spawn() */
+    if (flag == (CLONE_VM | CLONE_VFORK | SIGCHLD)) {
+        return vfork((uint64_t)childstk);
     }
-    return fork();
+    cprintf("sys_clone: flags 0x%x are not supported.\n", flag);
+    return -1;
 }
 
+/* Convert ticks of the system counter to a timeval. */
+static void
+ticks2tv(uint64_t t, struct timeval *tv)
+{
+    uint64_t f = timerfreq();
+
+    tv->tv_sec = t / f;
+    tv->tv_usec = (t % f) * 1000000 / f;
+}
 
-int
+/* Fill the fields of r we keep track of from u, zero the rest. */
+static void
+fill_rusage(struct rusage *r, struct usage *u)
+{
+    memset(r, 0, sizeof(*r));
+    ticks2tv(u->utime, &r->ru_utime);
+    ticks2tv(u->stime, &r->ru_stime);
+    r->ru_minflt = u->minflt;
+    r->ru_majflt = u->majflt;
+    r->ru_nvcsw = u->nvcsw;
+    r->ru_nivcsw = u->nivcsw;
+}
+
+int64_t
 sys_wait4()
 {
     int64_t pid, opt;
     int *wstatus;
     void *rusage;
+    struct usage u;
+    int r, status;
     if (argint(0, &pid) < 0 ||
         argint(1, &wstatus) < 0 ||
         argint(2, &opt) < 0 ||
         argint(3, &rusage) < 0)
         return -1;
 
-    if (pid != -1 || wstatus != 0 || opt != 0 || rusage != 0) {
-        cprintf("sys_wait4: unimplemented. pid %d, wstatus 0x%p, opt 0x%x, rusage 0x%p\n", pid, wstatus, opt, rusage);
+    /* No process groups, and no stopped children to report. */
+    if ((pid <= 0 && pid != -1) || (opt & ~(WNOHANG | WUNTRACED))) {
+        cprintf("sys_wait4: unimplemented. pid %d, opt 0x%x\n", pid, opt);
+        return -1;
+    }
+    if (wstatus && argptr(1, (char **)&wstatus, sizeof(*wstatus), 1) < 0)
+        return -EFAULT;
+    if (rusage && argptr(3, (char **)&rusage, sizeof(struct rusage), 1) < 0)
+        return -EFAULT;
+
+    if ((r = wait(pid, &status, opt & WNOHANG, &u)) > 0) {
+        if (wstatus)
+            *wstatus = status;
+        if (rusage)
+            fill_rusage(rusage, &u);
+    }
+    return r;
+}
+
+int64_t
+sys_getrusage()
+{
+    uint64_t who;
+    struct rusage *r;
+
+    if (argint(0, &who) < 0 || argptr(1, (char **)&r, sizeof(*r), 1) < 0)
+        return -EFAULT;
+    /* who is an int in the C interface, RUSAGE_CHILDREN is -1. */
+    if ((int)who == RUSAGE_SELF)
+        fill_rusage(r, &thisproc()->ru);
+    else if ((int)who == RUSAGE_CHILDREN)
+        fill_rusage(r, &thisproc()->cru);
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * Times are in clock ticks of 1/100 s, which is what musl's
+ * sysconf(_SC_CLK_TCK) reports. Returns the ticks since boot.
+ */
+int64_t
+sys_times()
+{
+    struct tms *tms;
+    struct proc *p = thisproc();
+    uint64_t f = timerfreq() / 100;
+
+    if (argint(0, (uint64_t *)&tms) < 0)
         return -1;
+    if (tms) {
+        if (argptr(0, (char **)&tms, sizeof(*tms), 1) < 0)
+            return -EFAULT;
+        tms->tms_utime = p->ru.utime / f;
+        tms->tms_stime = p->ru.stime / f;
+        tms->tms_cutime = p->cru.utime / f;
+        tms->tms_cstime = p->cru.stime / f;
     }
+    return timestamp() / f;
+}
+
+/*
+ * Convert ts to ticks of the system counter, saturating at
+ * UINT64_MAX so that a huge timeout stays huge.
+ */
+static uint64_t
+ts2ticks(struct timespec *ts)
+{
+    uint64_t f = timerfreq(), ns = ts->tv_nsec * f / 1000000000;
+
+    if ((uint64_t)ts->tv_sec > (UINT64_MAX - ns) / f)
+        return UINT64_MAX;
+    return ts->tv_sec * f + ns;
+}
+
+/* a + b, saturating at UINT64_MAX. */
+static uint64_t
+addsat(uint64_t a, uint64_t b)
+{
+    return a + b < a ? UINT64_MAX : a + b;
+}
+
+static int
+badts(struct timespec *ts)
+{
+    return ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= 1000000000;
+}
 
-    return wait();
+/*
+ * There are no signals to interrupt a sleep, so the time
+ * remaining is never written back.
+ */
+int64_t
+sys_nanosleep()
+{
+    struct timespec *req;
+
+    if (argptr(0, (char **)&req, sizeof(*req), 0) < 0)
+        return -EFAULT;
+    if (badts(req))
+        return -1;
+    return sleep_until(addsat(timestamp(), ts2ticks(req)));
+}
+
+/*
+ * Both clocks count from boot, there is no real time clock
+ * to set CLOCK_REALTIME from.
+ */
+int64_t
+sys_clock_nanosleep()
+{
+    uint64_t clk, flags;
+    struct timespec *req;
+    uint64_t deadline;
+
+    if (argint(0, &clk) < 0 || argint(1, &flags) < 0 ||
+        argptr(2, (char **)&req, sizeof(*req), 0) < 0)
+        return -EFAULT;
+    if (badts(req))
+        return -1;
+    if (clk != CLOCK_REALTIME && clk != CLOCK_MONOTONIC)
+        return -1;
+    deadline = ts2ticks(req);
+    if (!(flags & TIMER_ABSTIME))
+        deadline = addsat(deadline, timestamp());
+    return sleep_until(deadline);
+}
+
+int64_t
+sys_clock_gettime()
+{
+    uint64_t clk, t = timestamp(), f = timerfreq();
+    struct timespec *tp;
+
+    if (argint(0, &clk) < 0 || argptr(1, (char **)&tp, sizeof(*tp), 1) < 0)
+        return -EFAULT;
+    if (clk != CLOCK_REALTIME && clk != CLOCK_MONOTONIC)
+        return -1;
+    tp->tv_sec = t / f;
+    tp->tv_nsec = (t % f) * 1000000000 / f;
+    return 0;
+}
+
+/*
+ * The cpu mask is a single word, of which the caller may pass
+ * fewer bytes, as Linux allows.
+ */
+int64_t
+sys_sched_setaffinity()
+{
+    uint64_t pid, len, mask = 0;
+    char *set;
+
+    if (argint(0, &pid) < 0 || argint(1, &len) < 0)
+        return -1;
+    len = MIN(len, sizeof(mask));
+    if (argptr(2, &set, len, 0) < 0)
+        return -EFAULT;
+    memmove(&mask, set, len);
+    return set_cpus_allowed(pid, mask);
+}
+
+/* Returns the size of the mask written, as Linux does. */
+int64_t
+sys_sched_getaffinity()
+{
+    uint64_t pid, len, mask;
+    char *set;
+    int r;
+
+    if (argint(0, &pid) < 0 || argint(1, &len) < 0 || len < sizeof(mask))
+        return -1;
+    if (argptr(2, &set, sizeof(mask), 1) < 0)
+        return -EFAULT;
+    if ((r = get_cpus_allowed(pid)) < 0)
+        return -1;
+    mask = r;
+    memmove(set, &mask, sizeof(mask));
+    return sizeof(mask);
+}
+
+int64_t
+sys_setpriority()
+{
+    uint64_t which, who, prio;
+
+    if (argint(0, &which) < 0 || argint(1, &who) < 0 || argint(2, &prio) < 0)
+        return -1;
+    if (which != PRIO_PROCESS)
+        return -1;
+    return set_nice(who, (int)prio);
+}
+
+/* Like Linux, returns 20 - nice so that it is never negative. */
+int64_t
+sys_getpriority()
+{
+    uint64_t which, who;
+    int nice;
+
+    if (argint(0, &which) < 0 || argint(1, &who) < 0)
+        return -1;
+    if (which != PRIO_PROCESS || get_nice(who, &nice) < 0)
+        return -1;
+    return 20 - nice;
 }
@@ -7,34 +7,90 @@
 #include "proc.h"
 #include "defs.h"
 
-static int dt = 19200000;
+static uint64_t dt;          /* Counter ticks per scheduler tick */
+
+/*
+ * The timer of each cpu is armed for whichever comes first, its
+ * next scheduler tick or the next event on its timer wheel. The
+ * tick is off while the cpu is idle.
+ */
+static struct {
+    int stopped;             /* No tick while idle */
+    uint64_t tick;           /* Counter value of the next tick */
+} tickers[NCPU];
+
+/* Arm the timer of this cpu for its next tick or timer, if any. */
+void
+timer_program()
+{
+    uint64_t next = wheel_next();
+
+    if (!tickers[cpuid()].stopped) {
+        next = MIN(next, tickers[cpuid()].tick);
+    }
+    if (next == ~0UL) {
+        asm volatile("msr cntp_ctl_el0, %[x]" : : [x]"r"(0));
+    } else {
+        asm volatile("msr cntp_cval_el0, %[x]" : : [x]"r"(next));
+        asm volatile("msr cntp_ctl_el0, %[x]" : : [x]"r"(1));
+    }
+}
 
 void
 timer_init()
 {
-    asm volatile("msr cntp_ctl_el0, %[x]" : : [x]"r"(1));
-    asm volatile("msr cntp_tval_el0, %[x]" : : [x]"r"(dt));
+    /* Let user mode read cntvct_el0 for cheap timestamps (EL0VCTEN). */
+    asm volatile("msr cntkctl_el1, %[x]" : : [x]"r"(1 << 1));
+    dt = timerfreq() / HZ;
+    tickers[cpuid()].tick = timestamp() + dt;
+    timer_program();
     put32(CORE_TIMER_CTRL(cpuid()), CORE_TIMER_ENABLE);
 }
 
+/* Turn off the tick of this cpu while it has nothing to run. */
+void
+timer_stop()
+{
+    if (!tickers[cpuid()].stopped) {
+        tickers[cpuid()].stopped = 1;
+        timer_program();
+    }
+}
+
+/* Turn the tick back on, a full period from now. */
 void
-timer_reset()
+timer_start()
 {
-    asm volatile("msr cntp_tval_el0, %[x]" : : [x]"r"(dt));
+    if (tickers[cpuid()].stopped) {
+        tickers[cpuid()].stopped = 0;
+        tickers[cpuid()].tick = timestamp() + dt;
+        timer_program();
+    }
 }
 
 /*
  * This is a per-cpu non-stable version of clock, frequency of 
  * which is determined by cpu clock (may be tuned for power saving).
+ * Runs the timers that are due and charges the running process a
+ * tick if one is due.
  */
 void
 timer()
 {
+    uint64_t now = timestamp();
+    int tick = 0;
+
 #ifdef PRINT_TRACE
     cprintf("timer: cpu %d timer.\n", cpuid());
 #endif
-    drop_priority();
-    // cprintf("timer: pid %d dropped\n", thiscpu->proc->pid);
-    yield();
-    
+    wheel_run(now);
+    if (!tickers[cpuid()].stopped && now >= tickers[cpuid()].tick) {
+        tickers[cpuid()].tick = now + dt;
+        tick = 1;
+    }
+    timer_program();
+    if (tick && thiscpu->proc && sched_tick()) {
+        // cprintf("timer: pid %d dropped\n", thiscpu->proc->pid);
+        preempt();
+    }
 }
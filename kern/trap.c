@@ -3,6 +3,7 @@
 #include "arm.h"
 #include "sysregs.h"
 #include "mmu.h"
+#include "types.h"
 #include <syscall.h>
 #include "peripherals/irq.h"
 
@@ -24,17 +25,34 @@ irq_init()
     put32(GPU_INT_ROUTE, GPU_IRQ2CORE(0));
 }
 
+/* Let other cpus interrupt this one through its mailbox 0. */
+void
+ipi_init()
+{
+    put32(MBOX_CLR(cpuid(), 0), ~0U);
+    put32(MBOX_CTRL(cpuid()), MBOX_IRQ(0));
+}
+
+/* Interrupt cpu c, e.g. to wake it up from wfi(). */
+void
+ipi_send(int c)
+{
+    put32(MBOX_SET(c, 0), 1);
+}
+
 void
 interrupt(struct trapframe *tf)
 {
     struct proc *proc = thiscpu->proc;
     int src = get32(IRQ_SRC_CORE(cpuid()));
     if (src & IRQ_CNTPNSIRQ) {
-        timer_reset();
         timer();
     } else if (src & IRQ_TIMER) {
         clock_reset();
         clock();
+    } else if (src & IRQ_MAILBOX0) {
+        /* Only a wakeup, the scheduler checks its run queue again. */
+        put32(MBOX_CLR(cpuid(), 0), ~0U);
     } else if (src & IRQ_GPU) {
         int p1 = get32(IRQ_PENDING_1), p2 = get32(IRQ_PENDING_2);
         if (p1 & AUX_INT) {
@@ -46,8 +64,38 @@ interrupt(struct trapframe *tf)
         }
     } else {
         int src2 = resr();
-        cprintf("unexpected interrupt at cpu %d, src=0x%x, resr=0x%x, pid=%d\n", cpuid(), src, src2, proc->pid);
+        cprintf("unexpected interrupt at cpu %d, src=0x%x, resr=0x%x, pid=%d\n", cpuid(), src, src2, proc ? proc->pid : 0);
+    }
+}
+
+/*
+ * Handle a data abort on user address va, taken either from
+ * user mode or by the kernel touching user memory.
+ * Returns 0 if the access can be retried.
+ */
+static int
+pgfault(uint64_t va, int iss)
+{
+    struct proc *p = thisproc();
+    int dfsc = iss & ISS_DFSC_MASK, r;
+
+    if (p == 0 || va >= UADDR_SZ) {
+        return -1;
+    }
+    if (va >= p->sz) {
+        return vma_fault(p, va, iss & ISS_WNR);
     }
+    if (DFSC_PERM_FAULT(dfsc) && (iss & ISS_WNR)) {
+        r = uvm_cow(p->pgdir, ROUNDDOWN(va, PGSIZE));
+    } else if (DFSC_TRANS_FAULT(dfsc) && va >= p->ustack) {
+        r = uvm_demand(p->pgdir, ROUNDDOWN(va, PGSIZE));
+    } else {
+        return -1;
+    }
+    if (r == 0) {
+        p->ru.minflt++;
+    }
+    return r;
 }
 
 void
@@ -55,7 +103,11 @@ trap(struct trapframe *tf)
 {
     struct proc *proc = thiscpu->proc;
     int ec = resr() >> EC_SHIFT, iss = resr() & ISS_MASK;
+    uint64_t far = rfar();
     lesr(0);  /* Clear esr. */
+    if (proc && (tf->spsr & SPSR_M_MASK) == 0) {
+        charge(1);
+    }
     switch (ec) {
     case EC_UNKNOWN:
         interrupt(tf);
@@ -71,9 +123,40 @@ trap(struct trapframe *tf)
         }
         break;
 
+    case EC_DABORT:
+        if (pgfault(far, iss) < 0) {
+            cprintf("pid %d: data abort at 0x%p, pc 0x%p, iss 0x%x, killed\n",
+                    proc->pid, far, tf->elr, iss);
+            exit();
+        }
+        break;
+
+    case EC_DABORT_EL1:
+        /*
+         * System calls check user buffers with uaccess() first,
+         * which also faults in every page that needs memory, so
+         * this is a kernel bug rather than running out of memory.
+         */
+        if (pgfault(far, iss) < 0) {
+            panic("trap: kernel data abort at 0x%p, pc 0x%p, iss 0x%x\n",
+                  far, tf->elr, iss);
+        }
+        break;
+
     default:
         panic("trap: unexpected irq.\n");
     }
+
+    if (proc && (tf->spsr & SPSR_M_MASK) == 0) {
+        if (proc->killed) {
+            exit();
+        }
+        /* Let a higher priority process woken meanwhile run first. */
+        if (need_resched()) {
+            preempt();
+        }
+        charge(0);
+    }
 }
 
 void
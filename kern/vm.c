@@ -11,6 +11,28 @@
 
 extern uint64_t *kpgdir;
 
+/*
+ * ASID allocator. An ASID is valid while its generation, kept in
+ * the bits above ASID_BITS of p->asid, is the current one. When
+ * the ASIDs of a generation run out a new one begins, and each
+ * cpu flushes its TLB once before loading an ASID from it.
+ * ASID 0 is never handed out.
+ */
+static struct {
+    struct spinlock lock;
+    volatile uint64_t gen;
+    uint64_t next;
+    volatile uint64_t cpu_gen[NCPU];
+} asid;
+
+void
+asid_init()
+{
+    initlock(&asid.lock, "asid");
+    asid.gen = 1;
+    asid.next = 1;
+}
+
 /* 
  * Given 'pgdir', a pointer to a page directory, pgdir_walk returns
  * a pointer to the page table entry (PTE) for virtual address 'va'.
@@ -18,13 +40,13 @@ extern uint64_t *kpgdir;
  *
  * The relevant page table page might not exist yet.
  * If this is true, and alloc == false, then pgdir_walk returns NULL.
- * Otherwise, pgdir_walk allocates a new page table page with kalloc.
+ * Otherwise, pgdir_walk allocates a new page table page with kalloc_zeroed.
  *   - If the allocation fails, pgdir_walk returns NULL.
  *   - Otherwise, the new page is cleared, and pgdir_walk returns
  *     a pointer into the new page table page.
  */
 
-static uint64_t *
+uint64_t *
 pgdir_walk(uint64_t *pgdir, const void *va, int64_t alloc)
 {
     /* TODO: Your code here. */
@@ -38,10 +60,9 @@ pgdir_walk(uint64_t *pgdir, const void *va, int64_t alloc)
         if (*pte & PTE_P) {
             pgdir = (uint64_t *)P2V(PTE_ADDR(*pte)); /* Does not ensure pgdir[63:48] = 0 */
         } else {
-            if (!alloc || (pgdir = (uint64_t *)kalloc()) == 0)
+            if (!alloc || (pgdir = (uint64_t *)kalloc_zeroed()) == 0)
                 return NULL;
-            memset(pgdir, 0, PGSIZE);
-            *pte = V2P(PTE_ADDR(pgdir)) | PTE_P | PTE_TABLE;
+            *pte = V2P(pgdir) | PTE_P | PTE_TABLE;
         }
     }
     return &pgdir[PTX(3, va)];
@@ -71,7 +92,7 @@ map_region(uint64_t *pgdir, void *va, uint64_t size, uint64_t pa, int64_t perm)
             return -1;
         if (*pte & PTE_P)
             panic("remap");
-        *pte = PTE_ADDR(pa) | perm | PTE_P | PTE_TABLE | PTE_AF | PTE_NORMAL;
+        *pte = PTE_ADDR(pa) | perm | PTE_P | PTE_TABLE | PTE_AF | PTE_NORMAL | PTE_NG;
         if (a == last)
             break;
         a += PGSIZE;
@@ -85,6 +106,8 @@ map_region(uint64_t *pgdir, void *va, uint64_t size, uint64_t pa, int64_t perm)
  * Free a page table.
  *
  * Hint: You need to free all existing PTEs for this pgdir.
+ * Pages shared copy-on-write only lose one reference.
+ * Call with level 0 on the root of a page table.
  */
 
 void
@@ -116,10 +139,9 @@ pgdir_init()
     /* TODO: Your code here. */
     uint64_t *pgt;
 
-    if ((pgt = (uint64_t *)kalloc()) == 0)
+    if ((pgt = (uint64_t *)kalloc_zeroed()) == 0)
         panic("pgdir_init: kalloc failed\n");
     
-    memset(pgt, 0, PGSIZE);
     return pgt;
 }
 
@@ -138,8 +160,7 @@ uvm_init(uint64_t *pgdir, char *binary, int sz)
     if (sz > PGSIZE)
         panic("uvm_init: page overflow!\n");
     
-    mem = kalloc();
-    memset(mem, 0, PGSIZE);
+    mem = kalloc_zeroed();
     map_region(pgdir, (void *)0, (uint64_t)PGSIZE, V2P(mem), PTE_USER|PTE_RW|PTE_PAGE);
     memmove(mem, (void *)binary, sz);
 }
@@ -151,10 +172,33 @@ void
 uvm_switch(struct proc *p)
 {
     /* TODO: Your code here. */
+    int c = cpuid();
+
     if (p->pgdir == 0)
         panic("uvm_switch: no pgdir\n");
 
-    lttbr0((uint64_t)V2P(p->pgdir));
+#ifdef NO_ASID
+    /* Every process runs with ASID 0, flush what the last one left. */
+    lttbr0((uint64_t)V2P(p->pgdir), 0);
+    tlbi_all();
+    return;
+#endif
+    if ((p->asid >> ASID_BITS) != asid.gen || asid.cpu_gen[c] != asid.gen) {
+        acquire(&asid.lock);
+        if ((p->asid >> ASID_BITS) != asid.gen) {
+            if (asid.next == NASID) {
+                asid.gen++;
+                asid.next = 1;
+            }
+            p->asid = (asid.gen << ASID_BITS) | asid.next++;
+        }
+        if (asid.cpu_gen[c] != asid.gen) {
+            tlbi_all();
+            asid.cpu_gen[c] = asid.gen;
+        }
+        release(&asid.lock);
+    }
+    lttbr0((uint64_t)V2P(p->pgdir), ASID(p->asid));
 }
 
 /*
@@ -175,13 +219,12 @@ uvm_alloc(uint64_t *pgdir, uint64_t oldsz, uint64_t newsz)
     }
     a = ROUNDUP(oldsz, PGSIZE);
     for (; a < newsz; a += PGSIZE) {
-        mem = kalloc();
+        mem = kalloc_zeroed();
         if (mem == 0) {
             cprintf("uvm_alloc: out of memory\n");
             uvm_dealloc(pgdir, newsz, oldsz);
             return 0;
         }
-        memset(mem, 0, PGSIZE);
         if (map_region(pgdir, (char *)a, PGSIZE, V2P(mem), PTE_RW|PTE_USER) < 0) {
             cprintf("uvm_alloc: out of memory (2)\n");
             uvm_dealloc(pgdir, newsz, oldsz);
@@ -212,7 +255,8 @@ uvm_dealloc(uint64_t *pgdir, uint64_t oldsz, uint64_t newsz)
     for (; a < oldsz; a += PGSIZE) {
         pte = pgdir_walk(pgdir, (char *)a, 0);
         if (!pte) {
-            a = ROUNDUP(a, BKSIZE);
+            /* No page table here; skip to the next block. */
+            a = ROUNDUP(a + 1, BKSIZE) - PGSIZE;
         } else if ((*pte & PTE_P) != 0) {
             pa = PTE_ADDR(*pte);
             if (pa == 0) {
@@ -301,6 +345,9 @@ copyout(uint64_t *pgdir, uint64_t va, void *p, uint64_t len)
     buf = (char *)p;
     while (len > 0) {
         va0 = (uint64_t)ROUNDDOWN(va, PGSIZE);
+        if (uvm_cow(pgdir, va0) < 0) {
+            return -1;
+        }
         pa0 = uva2ka(pgdir, (char *)va0);
         if (pa0 == 0) {
             return -1;
@@ -326,7 +373,7 @@ uva2ka(uint64_t *pgdir, char *uva)
     uint64_t *pte;
 
     pte = pgdir_walk(pgdir, uva, 0);
-    if ((*pte & PTE_P) == 0) {
+    if (pte == 0 || (*pte & PTE_P) == 0) {
         return 0;
     }
     if ((*pte & PTE_USER) == 0) {
@@ -337,39 +384,124 @@ uva2ka(uint64_t *pgdir, char *uva)
 
 /*
  * Given a parent process's page table, create a copy
- * of it for a child.
+ * of it for a child. Pages are not copied: writable pages
+ * become read-only copy-on-write in both page tables and
+ * gain a reference. The caller must flush the parent's TLB.
  */
 uint64_t *
-copyuvm(uint64_t* pgdir, uint64_t sz)
+copyuvm(uint64_t *pgdir, uint64_t sz)
 {
-    uint64_t* new_pgdir = pgdir_init();
-    if (new_pgdir == 0) {
+    uint64_t *new_pgdir;
+
+    if ((new_pgdir = pgdir_init()) == 0) {
         return 0;
-    } 
-    
-    for (uint64_t i = 0; i < sz; i += PGSIZE) {
-        uint64_t* pte = pgdir_walk(pgdir, (void*)i, 0);
+    }
+    if (uvm_copy(pgdir, new_pgdir, 0, sz, 0) < 0) {
+        vm_free(new_pgdir, 0);
+        return 0;
+    }
+    return new_pgdir;
+}
+
+/*
+ * Map the pages of pgdir in [start, end) into new_pgdir too.
+ * Unless share is set, writable pages become copy-on-write.
+ */
+int
+uvm_copy(uint64_t *pgdir, uint64_t *new_pgdir, uint64_t start, uint64_t end, int share)
+{
+    uint64_t *pte;
+    uint64_t pa;
+    int64_t perm;
+
+    for (uint64_t i = start; i < end; i += PGSIZE) {
+        pte = pgdir_walk(pgdir, (void *)i, 0);
+        /* Demand-zero pages not touched yet stay holes in the child. */
         if (pte == 0) {
-            panic("copyuvm\n");
+            i = ROUNDUP(i + 1, BKSIZE) - PGSIZE;
+            continue;
         } 
-        if (((*pte) & (PTE_PAGE | PTE_P)) == 0) {
-            panic("copyuvm\n");
+        if ((*pte & PTE_P) == 0) {
+            continue;
         } 
-        uint64_t pa = PTE_ADDR(*pte);
-        int64_t perm = *pte & (PTE_USER | PTE_RO);
-        uint64_t* page = (uint64_t *)kalloc();
-        if (page == 0) {
-            kfree((char *)new_pgdir);
-            return 0;
-        } 
-        memcpy(page, P2V(pa), PGSIZE);
-        if (map_region(new_pgdir, (void *) i, PGSIZE, V2P(page), perm) < 0) {
-            kfree((char *)new_pgdir);
-            return 0;
+        if (!share && (*pte & PTE_RO) == 0) {
+            *pte |= PTE_RO | PTE_COW;
+        }
+        pa = PTE_ADDR(*pte);
+        perm = *pte & (PTE_USER | PTE_RO | PTE_COW);
+        if (map_region(new_pgdir, (void *)i, PGSIZE, pa, perm) < 0) {
+            return -1;
         } 
+        kdup(P2V(pa));
     }
-    
-    return new_pgdir;
+    return 0;
+}
+
+/*
+ * Resolve a write to the copy-on-write page at user address va by
+ * giving pgdir a private, writable copy of it. The last sharer of
+ * a page just gets it back writable. Returns 0 if the page is
+ * writable now or was never copy-on-write, -1 if va is unmapped
+ * or memory ran out.
+ */
+int
+uvm_cow(uint64_t *pgdir, uint64_t va)
+{
+    uint64_t *pte;
+    char *old, *mem;
+
+    pte = pgdir_walk(pgdir, (void *)va, 0);
+    if (pte == 0 || (*pte & PTE_P) == 0) {
+        return -1;
+    }
+    if ((*pte & PTE_COW) == 0) {
+        return 0;
+    }
+
+    old = P2V(PTE_ADDR(*pte));
+    if (kref(old) == 1) {
+        *pte &= ~(PTE_RO | PTE_COW);
+    } else {
+        if ((mem = kalloc()) == 0) {
+            return -1;
+        }
+        memmove(mem, old, PGSIZE);
+        *pte = V2P(mem) | (*pte & ~PTE_ADDR(~0UL) & ~(PTE_RO | PTE_COW));
+        kfree(old);
+    }
+    tlbi_va(va);
+    return 0;
+}
+
+/* Map the kernel page mem at user address va with perm. */
+int
+uvm_map(uint64_t *pgdir, uint64_t va, char *mem, int64_t perm)
+{
+    return map_region(pgdir, (void *)va, PGSIZE, V2P(mem), perm);
+}
+
+/*
+ * Back the demand-zero user page at va with a fresh zeroed page.
+ * Returns 0 if va is mapped now, -1 if memory ran out.
+ */
+int
+uvm_demand(uint64_t *pgdir, uint64_t va)
+{
+    uint64_t *pte;
+    char *mem;
+
+    pte = pgdir_walk(pgdir, (void *)va, 0);
+    if (pte && (*pte & PTE_P)) {
+        return 0;
+    }
+    if ((mem = kalloc_zeroed()) == 0) {
+        return -1;
+    }
+    if (uvm_map(pgdir, va, mem, PTE_RW|PTE_USER) < 0) {
+        kfree(mem);
+        return -1;
+    }
+    return 0;
 }
 
 /*
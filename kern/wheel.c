@@ -0,0 +1,217 @@
+#include "types.h"
+#include "arm.h"
+#include "spinlock.h"
+#include "console.h"
+#include "proc.h"
+#include "timer.h"
+#include "wheel.h"
+#include "defs.h"
+
+/*
+ * Timer wheels.
+ *
+ * Timers are kept per cpu and run from its timer interrupt, see
+ * timer(). A wheel is advanced one jiffy at a time: whenever a
+ * slot of level l comes round, its timers are spread over the
+ * levels below, and the timers of the current level 0 slot are
+ * run. A cpu that goes idle keeps its timer armed for the next
+ * event on its wheel, see wheel_next().
+ */
+
+#define SLOT_MASK       (WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(l)  ((l) * WHEEL_BITS)
+#define WHEEL_SPAN      (1UL << LEVEL_SHIFT(WHEEL_LEVELS))
+
+static struct wheel {
+    struct spinlock lock;
+    uint64_t now;            /* Jiffies run so far */
+    int count;               /* Pending timers */
+    struct list_head slot[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheels[NCPU];
+
+static uint64_t res;         /* Counter ticks per jiffy */
+
+void
+wheel_init()
+{
+    struct wheel *w;
+
+    res = timerfreq() / WHEEL_HZ;
+    for (w = wheels; w < &wheels[NCPU]; w++) {
+        initlock(&w->lock, "wheel");
+        w->now = timestamp() / res;
+        for (int l = 0; l < WHEEL_LEVELS; l++) {
+            for (int i = 0; i < WHEEL_SLOTS; i++) {
+                INIT_LIST_HEAD(&w->slot[l][i]);
+            }
+        }
+    }
+}
+
+void
+ktimer_init(struct ktimer *t, void (*fn)(void *), void *arg)
+{
+    t->fn = fn;
+    t->arg = arg;
+    t->cpu = -1;
+}
+
+/*
+ * Put t into the slot of w it belongs to, as seen from jiffy base.
+ * A deadline beyond the reach of the wheel is put at its far end,
+ * to be placed again when that slot comes round.
+ */
+static void
+place(struct wheel *w, struct ktimer *t, uint64_t base)
+{
+    uint64_t e = MAX(t->expires, base);
+    int l;
+
+    for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+        if (e - base < (1UL << LEVEL_SHIFT(l + 1))) {
+            break;
+        }
+    }
+    if (e - base >= WHEEL_SPAN) {
+        e = base + WHEEL_SPAN - 1;
+    }
+    list_add_tail(&t->node, &w->slot[l][(e >> LEVEL_SHIFT(l)) & SLOT_MASK]);
+}
+
+/*
+ * Arm t to run once the system counter reaches deadline, on the
+ * wheel of this cpu. t must not be pending already.
+ */
+void
+ktimer_add(struct ktimer *t, uint64_t deadline)
+{
+    struct wheel *w = &wheels[cpuid()];
+
+    if (t->cpu >= 0) {
+        panic("ktimer_add: timer pending\n");
+    }
+    acquire(&w->lock);
+    t->expires = deadline / res + (deadline % res != 0);
+    t->cpu = cpuid();
+    place(w, t, w->now + 1);
+    w->count++;
+    release(&w->lock);
+
+    /* The new timer may be due before the next interrupt. */
+    timer_program();
+}
+
+/*
+ * Disarm t. Returns 1 if it was still pending, 0 if it has run
+ * or is running now.
+ */
+int
+ktimer_del(struct ktimer *t)
+{
+    struct wheel *w;
+    int c, ret = 0;
+
+    if ((c = t->cpu) < 0) {
+        return 0;
+    }
+    w = &wheels[c];
+    acquire(&w->lock);
+    if (t->cpu == c) {
+        list_del(&t->node);
+        t->cpu = -1;
+        w->count--;
+        ret = 1;
+    }
+    release(&w->lock);
+    return ret;
+}
+
+/* Spread the timers of the current slot of level l over the levels below. */
+static int
+cascade(struct wheel *w, int l)
+{
+    int i = (w->now >> LEVEL_SHIFT(l)) & SLOT_MASK;
+    struct list_head *slot = &w->slot[l][i], tmp;
+    struct ktimer *t;
+
+    INIT_LIST_HEAD(&tmp);
+    while (!list_empty(slot)) {
+        t = list_first_entry(slot, struct ktimer, node);
+        list_del(&t->node);
+        list_add_tail(&t->node, &tmp);
+    }
+    while (!list_empty(&tmp)) {
+        t = list_first_entry(&tmp, struct ktimer, node);
+        list_del(&t->node);
+        place(w, t, w->now);
+    }
+    return i;
+}
+
+/*
+ * Run the timers of this cpu that are due by counter value now.
+ * Called from timer() with interrupts masked.
+ */
+void
+wheel_run(uint64_t now)
+{
+    struct wheel *w = &wheels[cpuid()];
+    uint64_t target = now / res;
+    struct list_head *slot;
+    struct ktimer *t;
+    void (*fn)(void *);
+    void *arg;
+
+    acquire(&w->lock);
+    while (w->now < target) {
+        if (w->count == 0) {
+            w->now = target;
+            break;
+        }
+        w->now++;
+        if ((w->now & SLOT_MASK) == 0) {
+            for (int l = 1; l < WHEEL_LEVELS && cascade(w, l) == 0; l++)
+                ;
+        }
+        slot = &w->slot[0][w->now & SLOT_MASK];
+        while (!list_empty(slot)) {
+            t = list_first_entry(slot, struct ktimer, node);
+            list_del(&t->node);
+            t->cpu = -1;
+            w->count--;
+            /* t may be reused as soon as the lock is dropped. */
+            fn = t->fn;
+            arg = t->arg;
+            release(&w->lock);
+            fn(arg);
+            acquire(&w->lock);
+        }
+    }
+    release(&w->lock);
+}
+
+/*
+ * Counter value by which the wheel of this cpu needs to run
+ * again, either to run a timer or to cascade a slot that has
+ * timers. ~0 if it has none.
+ */
+uint64_t
+wheel_next()
+{
+    struct wheel *w = &wheels[cpuid()];
+    uint64_t next = ~0UL, p;
+    int l, d;
+
+    acquire(&w->lock);
+    for (l = 0; l < WHEEL_LEVELS && w->count > 0; l++) {
+        p = w->now >> LEVEL_SHIFT(l);
+        for (d = 1; d <= WHEEL_SLOTS; d++) {
+            if (!list_empty(&w->slot[l][(p + d) & SLOT_MASK])) {
+                next = MIN(next, (p + d) << LEVEL_SHIFT(l));
+                break;
+            }
+        }
+    }
+    release(&w->lock);
+    return next == ~0UL ? next : next * res;
+}
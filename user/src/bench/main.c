@@ -0,0 +1,281 @@
+// Kernel microbenchmarks.
+//
+// Usage: bench switch [iters] [pages]
+//        bench spawn [iters] [pages]
+//        bench sleep [iters] [us]
+//        bench syscalls
+//
+// Timings come from the virtual counter, which the kernel lets
+// user mode read directly.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define PGSIZE 4096
+
+static inline unsigned long
+rdcycle(void)
+{
+    unsigned long t;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+}
+
+static inline unsigned long
+freq(void)
+{
+    unsigned long f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    return f;
+}
+
+static void
+report(char *what, unsigned long ticks, int n)
+{
+    unsigned long ns = ticks * 1000000000UL / freq();
+    printf("%s: %d iterations, %lu ns total, %lu ns each\n",
+           what, n, ns, ns / n);
+}
+
+// Touch one byte in each of npages pages so that every switch
+// back has to find them in the TLB again.
+static void
+touch(char *buf, int npages)
+{
+    for (int i = 0; i < npages; i++)
+        buf[i * PGSIZE]++;
+}
+
+// Pin the calling process, and the children it forks from now
+// on, to the first cpu it may run on.
+static int
+pin(void)
+{
+    cpu_set_t set;
+    int c;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0)
+        return -1;
+    for (c = 0; c < CPU_SETSIZE - 1 && !CPU_ISSET(c, &set); c++)
+        ;
+    CPU_ZERO(&set);
+    CPU_SET(c, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+// Two processes on one cpu yield to each other. Each yield is a
+// round trip through the scheduler, so the time per iteration
+// approximates the cost of two context switches plus refilling
+// the TLB for the pages touched in between. Build the kernel with
+// NO_ASID to compare against flushing the TLB on every switch.
+int
+bench_switch(int argc, char *argv[])
+{
+    int n = argc > 2 ? atoi(argv[2]) : 10000;
+    int npages = argc > 3 ? atoi(argv[3]) : 0;
+    char *buf = 0;
+    unsigned long t;
+    int pid;
+
+    if (n <= 0 || npages < 0)
+        return 1;
+    if (npages > 0 && (buf = malloc(npages * PGSIZE)) == 0) {
+        printf("bench: out of memory\n");
+        return 1;
+    }
+    if (buf)
+        memset(buf, 0, npages * PGSIZE);
+    if (pin() < 0) {
+        printf("bench: sched_setaffinity failed\n");
+        return 1;
+    }
+
+    if ((pid = fork()) < 0) {
+        printf("bench: fork failed\n");
+        return 1;
+    }
+    if (pid == 0) {
+        for (int i = 0; i < n; i++) {
+            if (buf)
+                touch(buf, npages);
+            sched_yield();
+        }
+        exit(0);
+    }
+
+    t = rdcycle();
+    for (int i = 0; i < n; i++) {
+        if (buf)
+            touch(buf, npages);
+        sched_yield();
+    }
+    t = rdcycle() - t;
+    wait(NULL);
+
+    printf("switch (%d pages touched): ", npages);
+    report("yield", t, n);
+    return 0;
+}
+
+// Exit at once, for bench spawn to exec.
+int
+bench_nop(int argc, char *argv[])
+{
+    return 0;
+}
+
+// Start a child that execs "bench nop" and wait for it, once with
+// fork() and once with vfork(). The caller first dirties the given
+// number of heap pages, which fork() has to share copy-on-write
+// and vfork() does not.
+int
+bench_spawn(int argc, char *argv[])
+{
+    int n = argc > 2 ? atoi(argv[2]) : 1000;
+    int npages = argc > 3 ? atoi(argv[3]) : 0;
+    char *args[] = { "bench", "nop", 0 };
+    unsigned long t[2] = { 0, 0 };
+    char *buf;
+    int pid;
+
+    if (n <= 0 || npages < 0)
+        return 1;
+    if (npages > 0) {
+        if ((buf = malloc(npages * PGSIZE)) == 0) {
+            printf("bench: out of memory\n");
+            return 1;
+        }
+        touch(buf, npages);
+    }
+
+    for (int v = 0; v < 2; v++) {
+        for (int i = 0; i < n; i++) {
+            unsigned long t0 = rdcycle();
+            if ((pid = v ? vfork() : fork()) < 0) {
+                printf("bench: fork failed\n");
+                return 1;
+            }
+            if (pid == 0) {
+                execv(args[0], args);
+                _exit(1);
+            }
+            wait(NULL);
+            t[v] += rdcycle() - t0;
+        }
+    }
+
+    printf("spawn (%d pages dirty):\n", npages);
+    report("fork+exec+wait", t[0], n);
+    report("vfork+exec+wait", t[1], n);
+    return 0;
+}
+
+// Sleep for the given time over and over and report how late
+// each wakeup comes. A sleep of 0 us shows the bare cost of
+// arming a timer and going through the scheduler.
+int
+bench_sleep(int argc, char *argv[])
+{
+    int n = argc > 2 ? atoi(argv[2]) : 100;
+    long us = argc > 3 ? atol(argv[3]) : 1000;
+    struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+    unsigned long want = us * freq() / 1000000;
+    unsigned long t, late, min = ~0UL, max = 0, sum = 0;
+
+    if (n <= 0 || us < 0)
+        return 1;
+    for (int i = 0; i < n; i++) {
+        t = rdcycle();
+        if (nanosleep(&ts, 0) < 0) {
+            printf("bench: nanosleep failed\n");
+            return 1;
+        }
+        t = rdcycle() - t;
+        late = t > want ? t - want : 0;
+        min = late < min ? late : min;
+        max = late > max ? late : max;
+        sum += late;
+    }
+
+    printf("sleep %ld us: late by %lu us min, %lu us avg, %lu us max\n", us,
+           min * 1000000 / freq(), sum / n * 1000000 / freq(),
+           max * 1000000 / freq());
+    return 0;
+}
+
+// Mirrors the kernel's struct sysstat, see syscall.c.
+#define NHIST 24
+
+struct sysstat {
+    unsigned long count;
+    unsigned long ticks;
+    unsigned int hist[NHIST];
+};
+
+// Print the system call counts and latency histograms the kernel
+// keeps when built with SYSCALL_STATS. Bucket i of a histogram
+// holds the calls that took 2^i to 2^(i+1) counter ticks.
+int
+bench_syscalls(int argc, char *argv[])
+{
+    static struct sysstat st[512];
+    int fd, n;
+
+    if ((fd = open("sysstat", O_RDONLY)) < 0) {
+        mknod("sysstat", 2, 0);
+        fd = open("sysstat", O_RDONLY);
+    }
+    if (fd < 0 || (n = read(fd, st, sizeof(st))) <= 0) {
+        printf("bench: no system call statistics, build with SYSCALL_STATS\n");
+        return 1;
+    }
+    close(fd);
+
+    printf("nr   calls  avg ns  histogram (bucket:count)\n");
+    for (int i = 0; i < n / (int)sizeof(st[0]); i++) {
+        if (st[i].count == 0)
+            continue;
+        printf("%-4d %lu  %lu ", i, st[i].count,
+               st[i].ticks * 1000000000UL / freq() / st[i].count);
+        for (int b = 0; b < NHIST; b++) {
+            if (st[i].hist[b])
+                printf(" %d:%u", b, st[i].hist[b]);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+struct {
+    char *name;
+    int (*fn)(int, char **);
+} benches[] = {
+    { "switch", bench_switch },
+    { "spawn", bench_spawn },
+    { "sleep", bench_sleep },
+    { "nop", bench_nop },
+    { "syscalls", bench_syscalls },
+};
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("usage: bench <name> [args...]\n");
+        exit(1);
+    }
+    for (int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (strcmp(argv[1], benches[i].name) == 0)
+            exit(benches[i].fn(argc, argv));
+    }
+    printf("bench: unknown benchmark %s\n", argv[1]);
+    exit(1);
+}
@@ -1,5 +1,6 @@
 // Shell.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -54,6 +55,8 @@ struct backcmd {
 };
 
 int fork1(void);                // Fork but panics on failure.
+void spawn(char *);
+extern char whitespace[], symbols[];
 void panic(char *);
 struct cmd *parsecmd(char *);
 
@@ -182,6 +185,11 @@ main()
                 fprintf(stderr, "cannot cd %s\n", buf + 3);
             continue;
         }
+        if (strpbrk(buf, symbols) == 0) {
+            // No redirection, pipe or list: the common case.
+            spawn(buf);
+            continue;
+        }
         if (fork1() == 0)
             runcmd(parsecmd(buf));
         wait(NULL);
@@ -507,3 +515,45 @@ nulterminate(struct cmd *cmd)
     }
     return cmd;
 }
+
+// Run a command that has no redirections, pipes or lists.
+// The child borrows our memory through vfork() until it calls
+// exec, so no address space is copied only to be thrown away.
+// It may only exec or _exit, anything else would scribble on
+// the parent's stack and stdio state.
+void
+spawn(char *s)
+{
+    char *argv[MAXARGS];
+    int argc = 0;
+
+    for (;;) {
+        while (*s && strchr(whitespace, *s))
+            *s++ = 0;
+        if (*s == 0)
+            break;
+        if (argc == MAXARGS - 1) {
+            fprintf(stderr, "too many args\n");
+            return;
+        }
+        argv[argc++] = s;
+        while (*s && !strchr(whitespace, *s))
+            s++;
+    }
+    argv[argc] = 0;
+    if (argc == 0)
+        return;
+
+    switch (vfork()) {
+    case -1:
+        panic("vfork");
+    case 0:
+        execv(argv[0], argv);
+        // Raw writes, stderr's FILE belongs to the parent.
+        write(2, "exec ", 5);
+        write(2, argv[0], strlen(argv[0]));
+        write(2, " failed\n", 8);
+        _exit(1);
+    }
+    wait(NULL);
+}